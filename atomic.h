@@ -164,6 +164,21 @@ static inline gint64 atomic64_read (const volatile gint64 *v)
 {
 	return *v;
 }
+
+/*
+ * Compares and swaps the two words at v, which must be 16 byte
+ * aligned.  Returns non-zero if it swapped.
+ */
+static inline int atomic128_cmpxchg (volatile gint64 *v, gint64 old_lo, gint64 old_hi, gint64 new_lo, gint64 new_hi)
+{
+	unsigned char ok;
+
+	__asm__ __volatile__ ("lock; cmpxchg16b %1; setz %0"
+			      : "=q" (ok), "+m" (*(volatile gint64 (*)[2])v), "+a" (old_lo), "+d" (old_hi)
+			      : "b" (new_lo), "c" (new_hi)
+			      : "memory");
+	return ok;
+}
 #endif
 
 static inline gint32 InterlockedIncrement(volatile gint32 *val)
@@ -34,4 +34,7 @@ typedef unsigned long guint64;
 #define TRUE	1
 #define FALSE	0
 
+#define MIN(a,b)	(((a) < (b)) ? (a) : (b))
+#define MAX(a,b)	(((a) > (b)) ? (a) : (b))
+
 #endif
@@ -3,13 +3,22 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "mono-membar.h"
 #include "delayed-free.h"
 #include "mono-mmap.h"
-#include "lock-free-array-queue.h"
+#include "atomic.h"
 #include "hazard-pointer.h"
 
+#ifdef __NR_membarrier
+#include <linux/membarrier.h>
+#define HAVE_MEMBARRIER
+#endif
+
 #define mono_pagesize getpagesize
 
 typedef struct {
@@ -22,10 +31,44 @@ static struct {
 	long long hazardous_pointer_count;
 } mono_stats;
 
+/*
+ * Every thread collects the pointers it retires in a list and only
+ * checks them against the hazard pointers once there are enough of
+ * them, see retired_scan ().
+ */
 typedef struct {
 	int small_id;
+	DelayedFreeItem *retired;
+	int num_retired;
+	int retired_size;
+	DelayedFreeItem *retired_spare;
+	int retired_spare_size;
+	gpointer *hazards;	/* snapshot of all hazard pointers */
+	int hazards_size;
+	gboolean scanning;
+	int orphan_shard;	/* where we look for orphans next */
 } MonoInternalThread;
 
+/*
+ * When a thread exits, the pointers it has retired but not freed yet
+ * are orphaned in a batch, which goes onto one of several lock-free
+ * stacks, picked by the thread's small id, so that exiting threads
+ * don't all contend for the same word.  Scans adopt whole batches by
+ * swapping a stack out, so there is no ABA problem and nobody has to
+ * wait for anybody else.
+ */
+typedef struct _OrphanBatch OrphanBatch;
+struct _OrphanBatch {
+	OrphanBatch *next;
+	size_t alloc_size;
+	int num_items;
+	DelayedFreeItem *items;	/* follow the header */
+};
+
+#define NUM_ORPHAN_SHARDS	16
+
+static OrphanBatch * volatile orphan_shards [NUM_ORPHAN_SHARDS];
+
 static CRITICAL_SECTION small_id_mutex;
 static int small_id_table_size = 0;
 static int small_id_next = 0;
@@ -41,21 +84,27 @@ static MonoInternalThread **small_id_table = NULL;
 static volatile int hazard_table_size = 0;
 static MonoThreadHazardPointers * volatile hazard_table = NULL;
 
-/* The table where we keep pointers to blocks to be freed but that
-   have to wait because they're guarded by a hazard pointer. */
-static MonoLockFreeArrayQueue delayed_free_queue = MONO_LOCK_FREE_ARRAY_QUEUE_INIT (sizeof (DelayedFreeItem));
-
+/*
+ * We don't use malloc () here, so that the lock-free allocator, which
+ * needs hazard pointers, can be used to implement it.  Memory from
+ * mono_valloc () is zeroed.
+ */
 static void*
 mono_gc_alloc_fixed (size_t size, void *dummy)
 {
+	void *ptr;
+
 	g_assert (dummy == NULL);
-	return g_malloc0 (size);
+	ptr = mono_valloc (NULL, size, MONO_MMAP_READ | MONO_MMAP_WRITE);
+	/* None of our callers can do without their memory. */
+	g_assert (ptr != NULL);
+	return ptr;
 }
 
 static void
-mono_gc_free_fixed (void *ptr)
+mono_gc_free_fixed (void *ptr, size_t size)
 {
-	free (ptr);
+	mono_vfree (ptr, size);
 }
 
 /*
@@ -103,21 +152,21 @@ small_id_alloc (MonoInternalThread *thread)
 		//new_table = mono_gc_alloc_fixed (new_size * sizeof (MonoInternalThread*), mono_gc_make_root_descr_all_refs (new_size));
 		new_table = mono_gc_alloc_fixed (new_size * sizeof (MonoInternalThread*), NULL);
 		memcpy (new_table, small_id_table, small_id_table_size * sizeof (void*));
-		mono_gc_free_fixed (small_id_table);
+		mono_gc_free_fixed (small_id_table, small_id_table_size * sizeof (MonoInternalThread*));
 		small_id_table = new_table;
 		small_id_table_size = new_size;
 	}
 	thread->small_id = id;
 	g_assert (small_id_table [id] == NULL);
 	small_id_table [id] = thread;
-	small_id_next++;
-	if (small_id_next > small_id_table_size)
+	small_id_next = id + 1;
+	if (small_id_next >= small_id_table_size)
 		small_id_next = 0;
 
 	g_assert (id < HAZARD_TABLE_MAX_SIZE);
 	if (id >= hazard_table_size) {
 #if MONO_SMALL_CONFIG
-		hazard_table = g_malloc0 (sizeof (MonoThreadHazardPointers) * HAZARD_TABLE_MAX_SIZE);
+		hazard_table = mono_gc_alloc_fixed (sizeof (MonoThreadHazardPointers) * HAZARD_TABLE_MAX_SIZE, NULL);
 		hazard_table_size = HAZARD_TABLE_MAX_SIZE;
 #else
 		gpointer page_addr;
@@ -144,6 +193,8 @@ small_id_alloc (MonoInternalThread *thread)
 			hazard_table [id].hazard_pointers [i] = NULL;
 	}
 
+	hazard_table [id].active = TRUE;
+
 	if (id > highest_small_id) {
 		highest_small_id = id;
 		mono_memory_write_barrier ();
@@ -154,57 +205,353 @@ small_id_alloc (MonoInternalThread *thread)
 	return id;
 }
 
+/*
+ * Freed ids are handed out again lowest first, so that the ids in use
+ * stay packed at the bottom, and highest_small_id, which bounds every
+ * scan of the hazard table, comes down again after threads exit.
+ */
 static void
 small_id_free (int id)
 {
+	EnterCriticalSection (&small_id_mutex);
+
 	g_assert (id >= 0 && id < small_id_table_size);
 	g_assert (small_id_table [id] != NULL);
 
 	small_id_table [id] = NULL;
+	hazard_table [id].active = FALSE;
+	if (id < small_id_next)
+		small_id_next = id;
+	while (highest_small_id >= 0 && !small_id_table [highest_small_id])
+		--highest_small_id;
+
+	LeaveCriticalSection (&small_id_mutex);
 }
 
-static gboolean
-is_pointer_hazardous (gpointer p)
+static pthread_key_t this_internal_thread_key;
+
+/*
+ * Asymmetric fences.  Hazard pointers are published far more often
+ * than they're scanned, so if the kernel lets us, the scanner pays for
+ * the fence instead of the readers.  Readers only keep the compiler
+ * from reordering the hazard pointer store and the load that checks
+ * it, and before a scan membarrier () makes every other running thread
+ * of the process execute a full barrier, which orders the two just as
+ * an mfence in the reader would.  Threads that aren't running have
+ * gone through a full barrier when they were switched out.
+ *
+ * Without membarrier (), or with MONO_SMR_SYMMETRIC_FENCES set in the
+ * environment, readers fence themselves.
+ */
+gboolean mono_hazard_pointer_asymmetric_fences;
+
+static void
+asymmetric_fences_init (void)
 {
-	int i, j;
-	int highest = highest_small_id;
+#ifdef HAVE_MEMBARRIER
+	int cmds;
 
-	g_assert (highest < hazard_table_size);
+	if (getenv ("MONO_SMR_SYMMETRIC_FENCES"))
+		return;
 
-	for (i = 0; i <= highest; ++i) {
-		for (j = 0; j < HAZARD_POINTER_COUNT; ++j) {
-			if (hazard_table [i].hazard_pointers [j] == p)
-				return TRUE;
+	cmds = syscall (__NR_membarrier, MEMBARRIER_CMD_QUERY, 0);
+	if (cmds < 0 || !(cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED))
+		return;
+	if (syscall (__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) != 0)
+		return;
+
+	mono_hazard_pointer_asymmetric_fences = TRUE;
+#endif
+}
+
+/* The scanner's side of mono_hazard_pointer_fence (). */
+static void
+scan_fence (void)
+{
+#ifdef HAVE_MEMBARRIER
+	if (mono_hazard_pointer_asymmetric_fences) {
+		/* It can't fail once we're registered. */
+		int result = syscall (__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+		g_assert (result == 0);
+		return;
+	}
+#endif
+	mono_memory_barrier ();
+}
+
+/*
+ * Thread states are much smaller than a page, so we carve them out of
+ * shared pages.  Freed ones go on a free list, linked through their
+ * first word and protected by the small id mutex, and their pages are
+ * never unmapped.
+ */
+static gpointer thread_state_free_list;
+
+static MonoInternalThread*
+thread_state_alloc (void)
+{
+	MonoInternalThread *thread;
+
+	EnterCriticalSection (&small_id_mutex);
+	if (!thread_state_free_list) {
+		int num = mono_pagesize () / sizeof (MonoInternalThread);
+		char *page = mono_gc_alloc_fixed (mono_pagesize (), NULL);
+		int i;
+
+		for (i = num - 1; i >= 0; --i) {
+			gpointer state = page + i * sizeof (MonoInternalThread);
+			*(gpointer*)state = thread_state_free_list;
+			thread_state_free_list = state;
 		}
 	}
+	thread = thread_state_free_list;
+	thread_state_free_list = *(gpointer*)thread;
+	LeaveCriticalSection (&small_id_mutex);
 
-	return FALSE;
+	memset (thread, 0, sizeof (MonoInternalThread));
+	return thread;
 }
 
-static pthread_key_t this_internal_thread_key;
+static void
+thread_state_free (MonoInternalThread *thread)
+{
+	EnterCriticalSection (&small_id_mutex);
+	*(gpointer*)thread = thread_state_free_list;
+	thread_state_free_list = thread;
+	LeaveCriticalSection (&small_id_mutex);
+}
 
 static MonoInternalThread*
 mono_thread_internal_current (void)
 {
 	MonoInternalThread *internal = pthread_getspecific (this_internal_thread_key);
 	if (!internal) {
-		internal = malloc (sizeof (MonoInternalThread));
-		memset (internal, 0, sizeof (MonoInternalThread));
+		internal = thread_state_alloc ();
+		internal->small_id = -1;
 		pthread_setspecific (this_internal_thread_key, internal);
 	}
 	return internal;
 }
 
+static void
+grow_array (gpointer *array, int *size, int min_size, size_t elem_size)
+{
+	int new_size = MAX (*size, 64);
+	gpointer new_array;
+
+	while (new_size < min_size)
+		new_size *= 2;
+	if (new_size == *size)
+		return;
+
+	new_array = mono_gc_alloc_fixed (new_size * elem_size, NULL);
+	if (*array) {
+		memcpy (new_array, *array, *size * elem_size);
+		mono_gc_free_fixed (*array, *size * elem_size);
+	}
+	*array = new_array;
+	*size = new_size;
+}
+
+static void
+retired_append (MonoInternalThread *thread, DelayedFreeItem *item)
+{
+	if (thread->num_retired == thread->retired_size)
+		grow_array ((gpointer*)&thread->retired, &thread->retired_size, thread->num_retired + 1, sizeof (DelayedFreeItem));
+	thread->retired [thread->num_retired++] = *item;
+}
+
+static int
+compare_pointers (const void *a, const void *b)
+{
+	gulong pa = (gulong)*(gpointer*)a;
+	gulong pb = (gulong)*(gpointer*)b;
+	return pa < pb ? -1 : pa > pb;
+}
+
+static void
+sift_down (gpointer *ptrs, int root, int n)
+{
+	gpointer p = ptrs [root];
+
+	for (;;) {
+		int child = root * 2 + 1;
+
+		if (child >= n)
+			break;
+		if (child + 1 < n && (gulong)ptrs [child + 1] > (gulong)ptrs [child])
+			++child;
+		if ((gulong)ptrs [child] <= (gulong)p)
+			break;
+		ptrs [root] = ptrs [child];
+		root = child;
+	}
+	ptrs [root] = p;
+}
+
+/*
+ * A heapsort.  glibc's qsort () mallocs a buffer for bigger arrays,
+ * which would re-enter the allocator from under a scan, or from under
+ * a magazine flush in the malloc front-end.
+ */
+void
+mono_sort_pointers (gpointer *ptrs, int n)
+{
+	int i;
+
+	for (i = n / 2 - 1; i >= 0; --i)
+		sift_down (ptrs, i, n);
+	for (i = n - 1; i > 0; --i) {
+		gpointer p = ptrs [i];
+		ptrs [i] = ptrs [0];
+		ptrs [0] = p;
+		sift_down (ptrs, 0, i);
+	}
+}
+
+/*
+ * A scan takes a snapshot of all hazard pointers, sorts it, and looks
+ * up each retired pointer in it.  We only scan once a thread has
+ * retired twice as many pointers as there are hazard pointers, so that
+ * at least half of them can be freed, which makes a retire O(1)
+ * amortized, instead of a walk over the hazard table each.
+ */
+#define RETIRED_MIN_SCAN	64
+
+static int
+retired_scan_threshold (void)
+{
+	return MAX (RETIRED_MIN_SCAN, 2 * (highest_small_id + 1) * HAZARD_POINTER_COUNT);
+}
+
+/*
+ * Frees what it can of the calling thread's retired pointers.  Free
+ * functions may retire more pointers, which just go onto the list
+ * without starting another scan.
+ */
+static void
+retired_scan (MonoInternalThread *thread, gboolean lock_free_context)
+{
+	int highest;
+	int num_hazards = 0, num_items, items_size, i, j;
+	DelayedFreeItem *items;
+
+	g_assert (!thread->scanning);
+
+	thread->scanning = TRUE;
+
+	scan_fence ();
+	highest = highest_small_id;
+	g_assert (highest < hazard_table_size);
+
+	grow_array ((gpointer*)&thread->hazards, &thread->hazards_size, (highest + 1) * HAZARD_POINTER_COUNT, sizeof (gpointer));
+	for (i = 0; i <= highest; ++i) {
+		if (!hazard_table [i].active)
+			continue;
+		for (j = 0; j < HAZARD_POINTER_COUNT; ++j) {
+			gpointer p = hazard_table [i].hazard_pointers [j];
+			if (p)
+				thread->hazards [num_hazards++] = p;
+		}
+	}
+	mono_sort_pointers (thread->hazards, num_hazards);
+
+	/* Start a fresh list, so that the free functions can retire onto it. */
+	items = thread->retired;
+	num_items = thread->num_retired;
+	items_size = thread->retired_size;
+	thread->retired = thread->retired_spare;
+	thread->num_retired = 0;
+	thread->retired_size = thread->retired_spare_size;
+	thread->retired_spare = items;
+	thread->retired_spare_size = items_size;
+
+	for (i = 0; i < num_items; ++i) {
+		DelayedFreeItem *item = &items [i];
+
+		if ((lock_free_context && item->might_lock) ||
+				bsearch (&item->p, thread->hazards, num_hazards, sizeof (gpointer), compare_pointers)) {
+			++mono_stats.hazardous_pointer_count;
+			retired_append (thread, item);
+		} else {
+			item->free_func (item->p);
+		}
+	}
+
+	thread->scanning = FALSE;
+}
+
+/*
+ * Takes over the pointers retired by threads that have exited, from
+ * the first non-empty shard, or from all of them.
+ */
+static void
+adopt_orphaned_items (MonoInternalThread *thread, gboolean all_shards)
+{
+	int i;
+
+	for (i = 0; i < NUM_ORPHAN_SHARDS; ++i) {
+		int shard = thread->orphan_shard;
+		OrphanBatch *batch;
+
+		thread->orphan_shard = (shard + 1) % NUM_ORPHAN_SHARDS;
+		if (!orphan_shards [shard])
+			continue;
+
+		batch = InterlockedExchangePointer ((gpointer * volatile)&orphan_shards [shard], NULL);
+		while (batch) {
+			OrphanBatch *next = batch->next;
+			int j;
+
+			for (j = 0; j < batch->num_items; ++j)
+				retired_append (thread, &batch->items [j]);
+			mono_gc_free_fixed (batch, batch->alloc_size);
+			batch = next;
+		}
+
+		if (!all_shards)
+			return;
+	}
+}
+
+static void
+retired_orphan (MonoInternalThread *thread)
+{
+	OrphanBatch * volatile *shard;
+	OrphanBatch *batch, *old_head;
+	size_t alloc_size;
+
+	if (!thread->num_retired)
+		return;
+
+	alloc_size = sizeof (OrphanBatch) + thread->num_retired * sizeof (DelayedFreeItem);
+	batch = mono_gc_alloc_fixed (alloc_size, NULL);
+	batch->alloc_size = alloc_size;
+	batch->num_items = thread->num_retired;
+	batch->items = (DelayedFreeItem*)(batch + 1);
+	memcpy (batch->items, thread->retired, thread->num_retired * sizeof (DelayedFreeItem));
+	thread->num_retired = 0;
+
+	shard = &orphan_shards [thread->small_id % NUM_ORPHAN_SHARDS];
+	do {
+		old_head = *shard;
+		batch->next = old_head;
+		mono_memory_write_barrier ();
+	} while (InterlockedCompareExchangePointer ((gpointer * volatile)shard, batch, old_head) != old_head);
+}
+
+/*
+ * A thread that uses hazard pointers after it has been detached, for
+ * example from another thread-specific data destructor, is attached
+ * again here, and detached again by the next round of destructors.
+ */
 MonoThreadHazardPointers*
 mono_hazard_pointer_get (void)
 {
 	MonoInternalThread *current_thread = mono_thread_internal_current ();
 
-	if (!(current_thread && current_thread->small_id >= 0)) {
-		static MonoThreadHazardPointers emerg_hazard_table;
-		g_warning ("Thread %p may have been prematurely finalized", current_thread);
-		return &emerg_hazard_table;
-	}
+	if (current_thread->small_id < 0)
+		small_id_alloc (current_thread);
 
 	return &hazard_table [current_thread->small_id];
 }
@@ -228,7 +575,7 @@ get_hazardous_pointer (gpointer volatile *pp, MonoThreadHazardPointers *hp, int
 		/* Make it hazardous */
 		mono_hazard_pointer_set (hp, hazard_index, p);
 
-		mono_memory_barrier ();
+		mono_hazard_pointer_fence ();
 
 		/* Check that it's still the same.  If not, try
 		   again. */
@@ -242,78 +589,167 @@ get_hazardous_pointer (gpointer volatile *pp, MonoThreadHazardPointers *hp, int
 	return p;
 }
 
-static gboolean
-try_free_delayed_free_item (gboolean lock_free_context)
-{
-	DelayedFreeItem item;
-	gboolean popped = mono_lock_free_array_queue_pop (&delayed_free_queue, &item);
-
-	if (!popped)
-		return FALSE;
-
-	if ((lock_free_context && item.might_lock) || (is_pointer_hazardous (item.p))) {
-		mono_lock_free_array_queue_push (&delayed_free_queue, &item);
-		return FALSE;
-	}
-
-	item.free_func (item.p);
-
-	return TRUE;
-}
-
 void
 mono_thread_hazardous_free_or_queue (gpointer p, MonoHazardousFreeFunc free_func,
 		gboolean free_func_might_lock, gboolean lock_free_context)
 {
-	int i;
+	MonoInternalThread *thread = mono_thread_internal_current ();
+	DelayedFreeItem item = { p, free_func, free_func_might_lock };
 
 	if (lock_free_context)
 		g_assert (!free_func_might_lock);
 	if (free_func_might_lock)
 		g_assert (!lock_free_context);
 
-	/* First try to free a few entries in the delayed free
-	   table. */
-	for (i = 0; i < 3; ++i)
-		try_free_delayed_free_item (lock_free_context);
+	retired_append (thread, &item);
 
-	/* Now see if the pointer we're freeing is hazardous.  If it
-	   isn't, free it.  Otherwise put it in the delay list. */
-	if (is_pointer_hazardous (p)) {
-		DelayedFreeItem item = { p, free_func, free_func_might_lock };
+	if (!thread->scanning && thread->num_retired >= retired_scan_threshold ()) {
+		adopt_orphaned_items (thread, FALSE);
+		retired_scan (thread, lock_free_context);
+	}
+}
+
+static gboolean
+is_pointer_hazardous (gpointer p)
+{
+	int highest, i, j;
 
-		++mono_stats.hazardous_pointer_count;
+	scan_fence ();
+	highest = highest_small_id;
+	g_assert (highest < hazard_table_size);
 
-		mono_lock_free_array_queue_push (&delayed_free_queue, &item);
-	} else {
-		free_func (p);
+	for (i = 0; i <= highest; ++i) {
+		if (!hazard_table [i].active)
+			continue;
+		for (j = 0; j < HAZARD_POINTER_COUNT; ++j) {
+			if (hazard_table [i].hazard_pointers [j] == p)
+				return TRUE;
+		}
 	}
+	return FALSE;
+}
+
+/*
+ * Frees p right away unless a hazard pointer refers to it, in which
+ * case it is retired like with mono_thread_hazardous_free_or_queue ().
+ * Every call walks the hazard table, so this is for the few pointers
+ * that shouldn't wait for a full list of retired ones, like memory
+ * that goes back to the OS, or that there is only a little of.
+ * Returns whether p was freed.
+ */
+gboolean
+mono_thread_hazardous_try_free (gpointer p, MonoHazardousFreeFunc free_func)
+{
+	if (is_pointer_hazardous (p)) {
+		mono_thread_hazardous_free_or_queue (p, free_func, FALSE, TRUE);
+		return FALSE;
+	}
+	free_func (p);
+	return TRUE;
 }
 
 void
 mono_thread_hazardous_try_free_all (void)
 {
-	while (try_free_delayed_free_item (FALSE))
-		;
+	MonoInternalThread *thread = mono_thread_internal_current ();
+
+	if (thread->scanning)
+		return;
+	adopt_orphaned_items (thread, TRUE);
+	retired_scan (thread, FALSE);
+}
+
+/*
+ * Scans until all of the calling thread's retired pointers, including
+ * the ones their free functions retire, are freed.  Hazard pointers
+ * are only held for a short while, so this doesn't wait for long, but
+ * the caller mustn't hold any itself.
+ */
+void
+mono_thread_hazardous_free_all (void)
+{
+	MonoInternalThread *thread = mono_thread_internal_current ();
+
+	if (thread->scanning)
+		return;
+	adopt_orphaned_items (thread, TRUE);
+	for (;;) {
+		retired_scan (thread, FALSE);
+		if (!thread->num_retired)
+			break;
+		sched_yield ();
+	}
 }
 
 void
 mono_thread_attach (void)
 {
-	small_id_alloc (mono_thread_internal_current ());
+	MonoInternalThread *thread = mono_thread_internal_current ();
+
+	if (thread->small_id < 0)
+		small_id_alloc (thread);
+}
+
+/*
+ * Frees what it can of the calling thread's retired pointers and
+ * orphans the rest, then gives up its small id and frees its state.
+ * We clear our own hazard pointers first, so that they don't keep our
+ * own retired pointers alive.
+ */
+void
+mono_thread_detach (void)
+{
+	MonoInternalThread *thread = pthread_getspecific (this_internal_thread_key);
+	int i;
+
+	if (!thread)
+		return;
+
+	if (thread->small_id >= 0) {
+		for (i = 0; i < HAZARD_POINTER_COUNT; ++i)
+			hazard_table [thread->small_id].hazard_pointers [i] = NULL;
+		mono_memory_write_barrier ();
+	}
+
+	if (thread->num_retired && !thread->scanning)
+		retired_scan (thread, FALSE);
+	retired_orphan (thread);
+
+	if (thread->small_id >= 0)
+		small_id_free (thread->small_id);
+
+	pthread_setspecific (this_internal_thread_key, NULL);
+
+	if (thread->retired)
+		mono_gc_free_fixed (thread->retired, thread->retired_size * sizeof (DelayedFreeItem));
+	if (thread->retired_spare)
+		mono_gc_free_fixed (thread->retired_spare, thread->retired_spare_size * sizeof (DelayedFreeItem));
+	if (thread->hazards)
+		mono_gc_free_fixed (thread->hazards, thread->hazards_size * sizeof (gpointer));
+	thread_state_free (thread);
+}
+
+/*
+ * By the time the destructor runs, the key's value is already NULL,
+ * but the free functions we call while detaching may need our state.
+ */
+static void
+thread_detach_destructor (gpointer thread)
+{
+	pthread_setspecific (this_internal_thread_key, thread);
+	mono_thread_detach ();
 }
 
 void
 mono_thread_smr_init (void)
 {
+	asymmetric_fences_init ();
 	pthread_mutex_init (&small_id_mutex, NULL);
-	pthread_key_create (&this_internal_thread_key, NULL);
+	pthread_key_create (&this_internal_thread_key, thread_detach_destructor);
 }
 
 void
 mono_thread_hazardous_print_stats (void)
 {
 	g_print ("hazardous pointers: %lld\n", mono_stats.hazardous_pointer_count);
-
-	mono_lock_free_array_queue_cleanup (&delayed_free_queue);
 }
@@ -12,15 +12,45 @@
 
 #define HAZARD_POINTER_COUNT 3
 
+/*
+ * Every thread's hazard pointers get a cache line of their own, so that
+ * setting them doesn't take the line away from other threads.  Scans
+ * skip records that no thread is attached to.  Define it to 32 for the
+ * packed layout, two records per line, to compare the two.
+ */
+#ifndef HAZARD_RECORD_SIZE
+#define HAZARD_RECORD_SIZE	64
+#endif
+
 typedef struct {
 	gpointer hazard_pointers [HAZARD_POINTER_COUNT];
+	gboolean active;
+	char padding [HAZARD_RECORD_SIZE - HAZARD_POINTER_COUNT * sizeof (gpointer) - sizeof (gboolean)];
 } MonoThreadHazardPointers;
 
 typedef void (*MonoHazardousFreeFunc) (gpointer p);
 
+extern gboolean mono_hazard_pointer_asymmetric_fences MONO_INTERNAL;
+
+/*
+ * Orders the store of a hazard pointer before the load that checks
+ * that the pointer is still current.  With asymmetric fences the
+ * scanner does the expensive part, see mono_thread_smr_init ().
+ */
+static inline void
+mono_hazard_pointer_fence (void)
+{
+	if (mono_hazard_pointer_asymmetric_fences)
+		__asm__ __volatile__ ("" : : : "memory");
+	else
+		mono_memory_barrier ();
+}
+
 void mono_thread_hazardous_free_or_queue (gpointer p, MonoHazardousFreeFunc free_func,
 		gboolean free_func_might_lock, gboolean lock_free_context) MONO_INTERNAL;
+gboolean mono_thread_hazardous_try_free (gpointer p, MonoHazardousFreeFunc free_func) MONO_INTERNAL;
 void mono_thread_hazardous_try_free_all (void) MONO_INTERNAL;
+void mono_thread_hazardous_free_all (void) MONO_INTERNAL;
 MonoThreadHazardPointers* mono_hazard_pointer_get (void) MONO_INTERNAL;
 gpointer get_hazardous_pointer (gpointer volatile *pp, MonoThreadHazardPointers *hp, int hazard_index) MONO_INTERNAL;
 
@@ -39,10 +69,17 @@ gpointer get_hazardous_pointer (gpointer volatile *pp, MonoThreadHazardPointers
 	} while (0)
 
 void mono_thread_attach (void);
+void mono_thread_detach (void);
 
 void mono_thread_smr_init (void) MONO_INTERNAL;
 void mono_thread_smr_cleanup (void) MONO_INTERNAL;
 
+/*
+ * Sorts pointers by address, in place.  Unlike qsort () it never
+ * allocates, so it can be used under a malloc () replacement.
+ */
+void mono_sort_pointers (gpointer *ptrs, int n) MONO_INTERNAL;
+
 void mono_thread_hazardous_print_stats (void) MONO_INTERNAL;
 
 #endif /*__MONO_HAZARD_POINTER_H__*/
@@ -39,7 +39,9 @@
  * descriptor before it can allocate from its superblock.  While it owns
  * the descriptor no other thread can acquire and hence allocate from
  * it.  A consequence of this is that the ABA problem cannot occur, so
- * we don't need the tag field and don't have to use 64 bit CAS.
+ * we don't need the tag field and don't have to use 64 bit CAS.  We
+ * still use a 64 bit anchor where we can, for the wider slot indexes,
+ * and give it a tag while we're at it.
  *
  * Descriptors are stored in two locations: The partial queue and the
  * active field.  They can only be in at most one of those at one time.
@@ -75,12 +77,25 @@
  * the superblock to the descriptor, so we only need one word of
  * metadata per superblock.
  *
- * FIXME: Having more than one allocator per size class is probably
- * buggy because it was never tested.
+ * There can be more than one allocator per size class, all sharing the
+ * size class's partial queue, which is how per-CPU heaps work.  A
+ * descriptor's heap is only a hint as to whose active field it should
+ * go back to.  It is updated whenever an allocator acquires the
+ * descriptor from the partial queue.  A free that acts on a stale heap
+ * just fails to CAS that heap's active field, which it has to handle
+ * anyway.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	/* for sched_getcpu () */
+#endif
+
 #include "fake-glib.h"
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "mono-mmap.h"
 #include "mono-membar.h"
@@ -99,6 +114,30 @@ enum {
 	STATE_EMPTY
 };
 
+/*
+ * Where we have a 64 bit CAS the anchor has room for superblocks with
+ * many more slots, which we need for big superblocks of tiny slots.
+ * The largest, a huge page of 8 byte slots, has 2^18 of them, so 20
+ * bits are enough for the count, and the rest goes to the tag.
+ * The tag is bumped by every CAS on the anchor.  The ownership
+ * protocol means we don't depend on it, but it makes the anchor safe
+ * against ABA for anybody who doesn't own the descriptor.
+ */
+#ifdef __x86_64__
+#define ANCHOR_64
+
+typedef union {
+	gint64 value;
+	struct {
+		guint64 avail : 20;
+		guint64 count : 20;
+		guint64 state : 2;
+		guint64 tag : 22;
+	} data;
+} Anchor;
+
+#define ANCHOR_INDEX_BITS	20
+#else
 typedef union {
 	gint32 value;
 	struct {
@@ -108,6 +147,16 @@ typedef union {
 	} data;
 } Anchor;
 
+#define ANCHOR_INDEX_BITS	15
+#endif
+
+#define ANCHOR_MAX_COUNT	((1 << ANCHOR_INDEX_BITS) - 1)
+
+/* Partial superblocks are linked through tagged nodes, see partial_push (). */
+#ifdef __x86_64__
+#define TAGGED_PARTIAL
+#endif
+
 typedef struct _MonoLockFreeAllocDescriptor Descriptor;
 struct _MonoLockFreeAllocDescriptor {
 	MonoLockFreeQueueNode node;
@@ -116,481 +165,2784 @@ struct _MonoLockFreeAllocDescriptor {
 	unsigned int slot_size;
 	unsigned int max_count;
 	gpointer sb;
+	unsigned int sb_size;
+	int cache_index;
+	int numa_node;
+	int stats_index;		/* of the size class that created it */
+	unsigned int trimmed;		/* slots on released pages, see below */
+	unsigned int bump;		/* first untouched slot, see chain_next () */
+	gboolean remote_free;		/* remote-free mode, see below */
+	pthread_t owner;
+	gpointer volatile remote_frees;
+#ifndef TAGGED_PARTIAL
+	Descriptor * volatile partial_next;	/* for the partial stacks */
+#endif
 #ifndef DESC_AVAIL_DUMMY
-	Descriptor * volatile next;
+	unsigned int slab_next;		/* free chain in the slab */
 #endif
 	gboolean in_use;	/* used for debugging only */
 };
 
-#define NUM_DESC_BATCH	64
-
-#define SB_SIZE		16384
-#define SB_HEADER_SIZE	16
-#define SB_USABLE_SIZE	(SB_SIZE - SB_HEADER_SIZE)
+/*
+ * Statistics.  Every thread has its own block of counters, with one
+ * set of counters per size class, so counting is a plain increment of
+ * a thread-local word.  A snapshot sums over the blocks of all threads,
+ * without synchronization, so it's only approximately consistent.
+ *
+ * Blocks are never freed, so that the counts of exited threads are
+ * not lost.  Instead, a thread takes over the block of an exited
+ * thread, if there is one.
+ *
+ * Superblock events are counted against the size class that created
+ * the descriptor, not the one it currently belongs to, which can
+ * change when a heap steals a partial descriptor from another node.
+ * Otherwise allocs and frees, or new and retired superblocks, of the
+ * same slots could end up in different classes.
+ */
+#define STATS_MAX_SIZE_CLASSES	512
+
+typedef struct {
+	gulong allocs;
+	gulong frees;
+	gulong anchor_cas_retries;
+	gulong new_sbs;
+	gulong retires;
+} ClassStats;
+
+typedef struct _StatsBlock StatsBlock;
+struct _StatsBlock {
+	StatsBlock *next;
+	volatile gint32 in_use;
+	ClassStats classes [STATS_MAX_SIZE_CLASSES];
+};
 
-#define SB_HEADER_FOR_ADDR(a)	((gpointer)((gulong)(a) & ~(gulong)(SB_SIZE-1)))
-#define DESCRIPTOR_FOR_ADDR(a)	(*(Descriptor**)SB_HEADER_FOR_ADDR (a))
+static StatsBlock * volatile stats_blocks;
+static volatile gint32 num_stats_classes;
+static pthread_key_t stats_key;
+static pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
 
-static gpointer
-alloc_sb (Descriptor *desc)
+static void
+stats_block_release (gpointer _block)
 {
-	gpointer sb_header = mono_sgen_alloc_os_memory_aligned (SB_SIZE, SB_SIZE, TRUE);
-	g_assert (sb_header == SB_HEADER_FOR_ADDR (sb_header));
-	DESCRIPTOR_FOR_ADDR (sb_header) = desc;
-	//g_print ("sb %p for %p\n", sb_header, desc);
-	return (char*)sb_header + SB_HEADER_SIZE;
+	StatsBlock *block = _block;
+	mono_memory_write_barrier ();
+	block->in_use = FALSE;
 }
 
 static void
-free_sb (gpointer sb)
+stats_key_init (void)
 {
-	gpointer sb_header = SB_HEADER_FOR_ADDR (sb);
-	g_assert ((char*)sb_header + SB_HEADER_SIZE == sb);
-	mono_sgen_free_os_memory (sb_header, SB_SIZE);
-	//g_print ("free sb %p\n", sb_header);
+	pthread_key_create (&stats_key, stats_block_release);
 }
 
-#ifndef DESC_AVAIL_DUMMY
-static Descriptor * volatile desc_avail;
-
-static Descriptor*
-desc_alloc (void)
+static StatsBlock*
+stats_block_get (void)
 {
-	MonoThreadHazardPointers *hp = mono_hazard_pointer_get ();
-	Descriptor *desc;
+	StatsBlock *block, *old_head;
 
-	for (;;) {
-		gboolean success;
+	pthread_once (&stats_key_once, stats_key_init);
+	block = pthread_getspecific (stats_key);
+	if (block)
+		return block;
 
-		desc = get_hazardous_pointer ((gpointer * volatile)&desc_avail, hp, 1);
-		if (desc) {
-			Descriptor *next = desc->next;
-			success = (InterlockedCompareExchangePointer ((gpointer * volatile)&desc_avail, next, desc) == desc);
-		} else {
-			size_t desc_size = sizeof (Descriptor);
-			Descriptor *d;
-			int i;
-
-			desc = mono_sgen_alloc_os_memory (desc_size * NUM_DESC_BATCH, TRUE);
-
-			/* Organize into linked list. */
-			d = desc;
-			for (i = 0; i < NUM_DESC_BATCH; ++i) {
-				Descriptor *next = (i == (NUM_DESC_BATCH - 1)) ? NULL : (Descriptor*)((char*)desc + ((i + 1) * desc_size));
-				d->next = next;
-				mono_lock_free_queue_node_init (&d->node, TRUE);
-				d = next;
-			}
+	for (block = stats_blocks; block; block = block->next) {
+		if (!block->in_use && InterlockedCompareExchange (&block->in_use, TRUE, FALSE) == FALSE)
+			break;
+	}
 
+	if (!block) {
+		block = mono_sgen_alloc_os_memory (sizeof (StatsBlock), TRUE);
+		block->in_use = TRUE;
+		do {
+			old_head = stats_blocks;
+			block->next = old_head;
 			mono_memory_write_barrier ();
+		} while (InterlockedCompareExchangePointer ((gpointer * volatile)&stats_blocks, block, old_head) != old_head);
+	}
 
-			success = (InterlockedCompareExchangePointer ((gpointer * volatile)&desc_avail, desc->next, NULL) == NULL);
-
-			if (!success)
-				mono_sgen_free_os_memory (desc, desc_size * NUM_DESC_BATCH);
-		}
+	pthread_setspecific (stats_key, block);
+	return block;
+}
 
-		mono_hazard_pointer_clear (hp, 1);
+#define STAT_ADD(index,field,n)	do {					\
+		if ((index) >= 0)					\
+			stats_block_get ()->classes [(index)].field += (n); \
+	} while (0)
 
-		if (success)
-			break;
+void
+mono_lock_free_allocator_get_stats (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocStats *stats)
+{
+	StatsBlock *block;
+
+	memset (stats, 0, sizeof (MonoLockFreeAllocStats));
+	stats->partial_queue_length = sc->partial_count;
+	if (sc->stats_index < 0)
+		return;
+
+	for (block = stats_blocks; block; block = block->next) {
+		ClassStats *cs = &block->classes [sc->stats_index];
+		stats->allocs += cs->allocs;
+		stats->frees += cs->frees;
+		stats->anchor_cas_retries += cs->anchor_cas_retries;
+		stats->new_superblocks += cs->new_sbs;
+		stats->retired_superblocks += cs->retires;
 	}
 
-	g_assert (!desc->in_use);
-	desc->in_use = TRUE;
-
-	return desc;
+	stats->live_superblocks = (long)(stats->new_superblocks - stats->retired_superblocks);
+	stats->live_bytes = (long)(stats->allocs - stats->frees) * (long)sc->slot_size;
 }
 
-static void
-desc_enqueue_avail (gpointer _desc)
-{
-	Descriptor *desc = _desc;
-	Descriptor *old_head;
+/*
+ * Superblocks are powers of two in size, between SB_MIN_SIZE and
+ * SB_MAX_SIZE, or SB_HUGE_SIZE if they're backed by huge pages, and
+ * aligned to their size.  The size is a property of the size class,
+ * see choose_sb_size ().
+ */
+#define SB_MIN_SIZE	16384
+#define SB_MAX_SIZE	(1024 * 1024)
+#define SB_HUGE_SIZE	(2 * 1024 * 1024)
+#define SB_HEADER_SIZE	16
+#define SB_USABLE_SIZE(sb_size)	((sb_size) - SB_HEADER_SIZE)
 
-	g_assert (desc->anchor.data.state == STATE_EMPTY);
-	g_assert (!desc->in_use);
+/*
+ * The slots start right after the header, unless they need stricter
+ * alignment, in which case the header gets padded to it.  Superblocks
+ * are aligned to their size, so aligning the start aligns all slots.
+ */
+#define SB_SLOTS_OFFSET(alignment)	MAX ((alignment), SB_HEADER_SIZE)
+#define SB_SLOTS_SIZE(sb_size,alignment)	((sb_size) - SB_SLOTS_OFFSET ((alignment)))
 
-	do {
-		old_head = desc_avail;
-		desc->next = old_head;
-		mono_memory_write_barrier ();
-	} while (InterlockedCompareExchangePointer ((gpointer * volatile)&desc_avail, desc, old_head) != old_head);
-}
+#define SB_HEADER_FOR_ADDR(a,sb_size)	((gpointer)((gulong)(a) & ~(gulong)((sb_size)-1)))
 
-static void
-desc_retire (Descriptor *desc)
+/*
+ * Because superblocks come in different sizes we can't get from an
+ * address to its superblock header by masking.  Instead we keep a map
+ * from each SB_MIN_SIZE sized chunk of the address space to the
+ * descriptor of the superblock containing it.  The map is a two level
+ * radix tree whose leaves are allocated on demand and never freed, so
+ * lookups need neither locks nor hazard pointers.
+ */
+#define PAGEMAP_SHIFT		14
+#if defined(__x86_64__) || defined(__LP64__)
+#define PAGEMAP_ADDR_BITS	48
+#else
+#define PAGEMAP_ADDR_BITS	32
+#endif
+#define PAGEMAP_LEAF_BITS	17
+#define PAGEMAP_ROOT_BITS	(PAGEMAP_ADDR_BITS - PAGEMAP_SHIFT - PAGEMAP_LEAF_BITS)
+#define PAGEMAP_LEAF_SIZE	(1 << PAGEMAP_LEAF_BITS)
+
+static Descriptor ** volatile pagemap_root [1 << PAGEMAP_ROOT_BITS];
+
+#define DESCRIPTOR_FOR_ADDR(a)	(pagemap_get (a))
+
+static inline Descriptor*
+pagemap_get (gpointer addr)
 {
-	g_assert (desc->anchor.data.state == STATE_EMPTY);
-	g_assert (desc->in_use);
-	desc->in_use = FALSE;
-	free_sb (desc->sb);
-	mono_thread_hazardous_free_or_queue (desc, desc_enqueue_avail, FALSE, TRUE);
+	gulong chunk = (gulong)addr >> PAGEMAP_SHIFT;
+	return pagemap_root [chunk >> PAGEMAP_LEAF_BITS] [chunk & (PAGEMAP_LEAF_SIZE - 1)];
 }
-#else
-MonoLockFreeQueue available_descs;
 
+/* Like pagemap_get (), but for addresses that might not be ours. */
 static Descriptor*
-desc_alloc (void)
+pagemap_get_safe (gpointer addr)
 {
-	Descriptor *desc = (Descriptor*)mono_lock_free_queue_dequeue (&available_descs);
+	gulong chunk = (gulong)addr >> PAGEMAP_SHIFT;
+	Descriptor **leaf;
 
-	if (desc)
-		return desc;
-
-	return calloc (1, sizeof (Descriptor));
+	if (chunk >> (PAGEMAP_ADDR_BITS - PAGEMAP_SHIFT))
+		return NULL;
+	leaf = pagemap_root [chunk >> PAGEMAP_LEAF_BITS];
+	if (!leaf)
+		return NULL;
+	return leaf [chunk & (PAGEMAP_LEAF_SIZE - 1)];
 }
 
 static void
-desc_retire (Descriptor *desc)
+pagemap_set (gpointer start, size_t size, Descriptor *desc)
 {
-	free_sb (desc->sb);
-	mono_lock_free_queue_enqueue (&available_descs, &desc->node);
+	gulong chunk = (gulong)start >> PAGEMAP_SHIFT;
+	gulong end = ((gulong)start + size) >> PAGEMAP_SHIFT;
+
+	g_assert (!((gulong)start & ((1 << PAGEMAP_SHIFT) - 1)));
+	g_assert (!(size & ((1 << PAGEMAP_SHIFT) - 1)));
+	g_assert (((gulong)start + size - 1) >> PAGEMAP_ADDR_BITS == 0);
+
+	for (; chunk < end; ++chunk) {
+		Descriptor ** volatile *leafp = &pagemap_root [chunk >> PAGEMAP_LEAF_BITS];
+		if (!*leafp) {
+			Descriptor **leaf = mono_sgen_alloc_os_memory (sizeof (Descriptor*) * PAGEMAP_LEAF_SIZE, TRUE);
+			if (InterlockedCompareExchangePointer ((gpointer * volatile)leafp, leaf, NULL) != NULL)
+				mono_sgen_free_os_memory (leaf, sizeof (Descriptor*) * PAGEMAP_LEAF_SIZE);
+		}
+		(*leafp) [chunk & (PAGEMAP_LEAF_SIZE - 1)] = desc;
+	}
+
+	mono_memory_write_barrier ();
 }
-#endif
 
-static Descriptor*
-list_get_partial (MonoLockFreeAllocSizeClass *sc)
+/*
+ * NUMA topology.  We find the nodes, and which CPUs belong to them, in
+ * sysfs.  Tests can simulate nodes instead, which get the CPUs round
+ * robin and whose memory is not actually bound.
+ *
+ * We read it all once, into a table from CPU to node, so that finding
+ * the current node is just sched_getcpu (), which doesn't need to
+ * enter the kernel, and a load.
+ */
+#define NUMA_MAX_CPUS	4096
+
+static int numa_num_nodes;
+static gboolean numa_simulated;
+static guint8 numa_cpu_nodes [NUMA_MAX_CPUS];
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+void
+mono_lock_free_numa_simulate (int num_nodes)
 {
-	for (;;) {
-		Descriptor *desc = (Descriptor*) mono_lock_free_queue_dequeue (&sc->partial);
-		if (!desc)
-			return NULL;
-		if (desc->anchor.data.state != STATE_EMPTY)
-			return desc;
-		desc_retire (desc);
+	g_assert (num_nodes >= 1 && num_nodes <= MONO_LOCK_FREE_NUMA_MAX_NODES);
+	numa_num_nodes = num_nodes;
+	numa_simulated = TRUE;
+}
+
+#ifdef __linux__
+/*
+ * Assigns the CPUs in the node's cpulist, like "0-3,8-11", to it.  We
+ * might be initializing malloc (), so this must not allocate.
+ */
+static void
+numa_read_cpulist (int node)
+{
+	char path [64], buf [4096];
+	char *p = buf;
+	int fd, len;
+
+	snprintf (path, sizeof (path), "/sys/devices/system/node/node%d/cpulist", node);
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return;
+	len = read (fd, buf, sizeof (buf) - 1);
+	close (fd);
+	if (len <= 0)
+		return;
+	buf [len] = 0;
+
+	while (*p >= '0' && *p <= '9') {
+		long first = strtol (p, &p, 10);
+		long last = first;
+
+		if (*p == '-')
+			last = strtol (p + 1, &p, 10);
+		for (; first <= last && first < NUMA_MAX_CPUS; ++first)
+			numa_cpu_nodes [first] = node;
+		if (*p == ',')
+			++p;
 	}
 }
+#endif
 
 static void
-desc_put_partial (gpointer _desc)
+numa_init (void)
 {
-	Descriptor *desc = _desc;
+	int cpu, node;
 
-	g_assert (desc->anchor.data.state != STATE_FULL);
+	if (numa_simulated) {
+		for (cpu = 0; cpu < NUMA_MAX_CPUS; ++cpu)
+			numa_cpu_nodes [cpu] = cpu % numa_num_nodes;
+		return;
+	}
 
-	mono_lock_free_queue_node_free (&desc->node);
-	mono_lock_free_queue_enqueue (&desc->heap->sc->partial, &desc->node);
+	node = 0;
+#ifdef __linux__
+	for (; node < MONO_LOCK_FREE_NUMA_MAX_NODES; ++node) {
+		char path [64];
+
+		snprintf (path, sizeof (path), "/sys/devices/system/node/node%d", node);
+		if (access (path, F_OK))
+			break;
+		numa_read_cpulist (node);
+	}
+#endif
+	numa_num_nodes = MAX (node, 1);
 }
 
-static void
-list_put_partial (Descriptor *desc)
+int
+mono_lock_free_numa_num_nodes (void)
 {
-	g_assert (desc->anchor.data.state != STATE_FULL);
-	mono_thread_hazardous_free_or_queue (desc, desc_put_partial, FALSE, TRUE);
+	pthread_once (&numa_once, numa_init);
+	return numa_num_nodes;
 }
 
-static void
-list_remove_empty_desc (MonoLockFreeAllocSizeClass *sc)
+int
+mono_lock_free_numa_node_of_cpu (int cpu)
 {
-	int num_non_empty = 0;
-	for (;;) {
-		Descriptor *desc = (Descriptor*) mono_lock_free_queue_dequeue (&sc->partial);
-		if (!desc)
-			return;
-		/*
-		 * We don't need to read atomically because we're the
-		 * only thread that references this descriptor.
-		 */
-		if (desc->anchor.data.state == STATE_EMPTY) {
-			desc_retire (desc);
-		} else {
-			g_assert (desc->heap->sc == sc);
-			mono_thread_hazardous_free_or_queue (desc, desc_put_partial, FALSE, TRUE);
-			if (++num_non_empty >= 2)
-				return;
-		}
-	}
+	mono_lock_free_numa_num_nodes ();
+	return cpu >= 0 && cpu < NUMA_MAX_CPUS ? numa_cpu_nodes [cpu] : 0;
 }
 
-static Descriptor*
-heap_get_partial (MonoLockFreeAllocator *heap)
+int
+mono_lock_free_numa_current_node (void)
 {
-	return list_get_partial (heap->sc);
+	if (mono_lock_free_numa_num_nodes () == 1)
+		return 0;
+
+#ifdef __linux__
+	return mono_lock_free_numa_node_of_cpu (sched_getcpu ());
+#else
+	return 0;
+#endif
 }
 
 static void
-heap_put_partial (Descriptor *desc)
+numa_bind (gpointer start, size_t size, int node)
 {
-	list_put_partial (desc);
+	if (!numa_simulated)
+		mono_vbind_node (start, size, node);
 }
 
-static gboolean
-set_anchor (Descriptor *desc, Anchor old_anchor, Anchor new_anchor)
-{
-	if (old_anchor.data.state == STATE_EMPTY)
-		g_assert (new_anchor.data.state == STATE_EMPTY);
+/*
+ * Retired superblocks are not unmapped right away but kept in a
+ * cache, one lock-free stack per superblock size, so that oscillating
+ * load doesn't have to go to the kernel for every superblock.  A
+ * cached superblock's header holds the stack link and its size.
+ *
+ * When a stack grows above the high watermark we release superblocks
+ * to the OS until it's down to the low one.  The watermarks are in
+ * bytes and apply to each superblock size separately.
+ *
+ * A pop reads the next link of the top entry, so it protects the entry
+ * with a hazard pointer, and entries are only released once no hazard
+ * pointer refers to them.  On x86_64 the tops are counted, like the
+ * partial node stacks, so an entry that comes back while a pop looks
+ * at it makes the pop's CAS fail, and pushes can happen right away.
+ * Elsewhere an entry is only pushed once no hazard pointer refers to
+ * it, see sb_stack_push_when_safe ().
+ */
+typedef struct _SBCacheEntry SBCacheEntry;
+struct _SBCacheEntry {
+	SBCacheEntry * volatile next;
+	unsigned int sb_size;
+	int node;
+};
+
+#ifdef TAGGED_PARTIAL
+typedef struct {
+	SBCacheEntry * volatile top;
+	volatile gint64 tag;
+	volatile gint32 count;
+} __attribute__ ((aligned (16))) SBStack;
+#else
+typedef struct {
+	SBCacheEntry * volatile top;
+	volatile gint32 count;
+} SBStack;
+#endif
 
-	return InterlockedCompareExchange (&desc->anchor.value, new_anchor.value, old_anchor.value) == old_anchor.value;
+/* One for each power of two from SB_MIN_SIZE to SB_HUGE_SIZE. */
+#define SB_NUM_BINS	8
+
+/* Superblocks are only reused on the NUMA node they belong to.  Index 0 is for "no node". */
+static SBStack sb_caches [MONO_LOCK_FREE_NUMA_MAX_NODES + 1][SB_NUM_BINS];
+static size_t sb_cache_low_bytes = 8 * 1024 * 1024;
+static size_t sb_cache_high_bytes = 32 * 1024 * 1024;
+
+static int
+sb_bin_for_size (unsigned int sb_size)
+{
+	int bin = 0;
+	while ((SB_MIN_SIZE << bin) < sb_size)
+		++bin;
+	g_assert ((SB_MIN_SIZE << bin) == sb_size && bin < SB_NUM_BINS);
+	return bin;
 }
 
-static gpointer
-alloc_from_active_or_partial (MonoLockFreeAllocator *heap)
+static SBCacheEntry*
+sb_stack_pop (SBStack *stack)
 {
-	Descriptor *desc;
-	Anchor old_anchor, new_anchor;
-	gpointer addr;
+	MonoThreadHazardPointers *hp = mono_hazard_pointer_get ();
+	SBCacheEntry *entry;
 
- retry:
-	desc = heap->active;
-	if (desc) {
-		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, NULL, desc) != desc)
-			goto retry;
-	} else {
-		desc = heap_get_partial (heap);
-		if (!desc)
-			return NULL;
+	for (;;) {
+#ifdef TAGGED_PARTIAL
+		/* The tag first, so that a top that changed since makes the CAS fail. */
+		gint64 tag = stack->tag;
+#endif
+		entry = get_hazardous_pointer ((gpointer * volatile)&stack->top, hp, 1);
+		if (!entry)
+			break;
+#ifdef TAGGED_PARTIAL
+		if (atomic128_cmpxchg ((volatile gint64*)stack, (gint64)entry, tag, (gint64)entry->next, tag + 1)) {
+#else
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&stack->top, entry->next, entry) == entry) {
+#endif
+			InterlockedDecrement (&stack->count);
+			break;
+		}
+		mono_hazard_pointer_clear (hp, 1);
 	}
 
-	/* Now we own the desc. */
+	mono_hazard_pointer_clear (hp, 1);
+	return entry;
+}
+
+/* Returns the number of entries on the stack after the push. */
+static gint32
+sb_stack_push (SBStack *stack, SBCacheEntry *entry)
+{
+	SBCacheEntry *old_top;
+#ifdef TAGGED_PARTIAL
+	gint64 tag;
 
 	do {
-		unsigned int next;
+		tag = stack->tag;
+		old_top = stack->top;
+		entry->next = old_top;
+		mono_memory_write_barrier ();
+	} while (!atomic128_cmpxchg ((volatile gint64*)stack, (gint64)old_top, tag, (gint64)entry, tag + 1));
+#else
+	do {
+		old_top = stack->top;
+		entry->next = old_top;
+		mono_memory_write_barrier ();
+	} while (InterlockedCompareExchangePointer ((gpointer * volatile)&stack->top, entry, old_top) != old_top);
+#endif
 
-		new_anchor = old_anchor = *(volatile Anchor*)&desc->anchor.value;
-		if (old_anchor.data.state == STATE_EMPTY) {
-			/* We must free it because we own it. */
-			desc_retire (desc);
-			goto retry;
-		}
-		g_assert (old_anchor.data.state == STATE_PARTIAL);
-		g_assert (old_anchor.data.count > 0);
+	return InterlockedIncrement (&stack->count);
+}
 
-		addr = (char*)desc->sb + old_anchor.data.avail * desc->slot_size;
+/*
+ * Calls push_func, which pushes entry onto a stack, once that's safe.
+ * Without counted tops that's when no pop is looking at the entry.
+ */
+static void
+sb_stack_push_when_safe (gpointer entry, MonoHazardousFreeFunc push_func)
+{
+#ifdef TAGGED_PARTIAL
+	push_func (entry);
+#else
+	mono_thread_hazardous_try_free (entry, push_func);
+#endif
+}
 
-		mono_memory_read_barrier ();
+/*
+ * In arena mode we reserve one big stretch of address space up front
+ * and carve superblocks out of it, aligned to their size, by bumping
+ * a pointer.  That way superblocks don't each need their own mapping,
+ * which costs several syscalls and, eventually, runs into the kernel's
+ * limit on the number of mappings.
+ *
+ * The arena is reserved inaccessible and we make the part below the
+ * bump pointer accessible as we go, so it stays a single mapping.
+ * Superblocks the cache releases are not unmapped but decommitted with
+ * madvise () and put on a free stack for their size, from which we
+ * take superblocks before bumping.
+ */
+static char *arena_start, *arena_end;
+static char * volatile arena_next;
+static SBStack arena_free_sbs [MONO_LOCK_FREE_NUMA_MAX_NODES + 1][SB_NUM_BINS];
 
-		next = *(unsigned int*)addr;
-		g_assert (next < SB_USABLE_SIZE / desc->slot_size);
+void
+mono_lock_free_allocator_init_arena (size_t size)
+{
+	char *mem;
 
-		new_anchor.data.avail = next;
-		--new_anchor.data.count;
+	g_assert (!arena_start);
 
-		if (new_anchor.data.count == 0)
-			new_anchor.data.state = STATE_FULL;
-	} while (!set_anchor (desc, old_anchor, new_anchor));
+	size = (size + SB_HUGE_SIZE - 1) & ~(SB_HUGE_SIZE - 1);
+	mem = mono_sgen_alloc_os_memory_aligned (size, SB_HUGE_SIZE, FALSE);
+	g_assert (mem);
 
-	/* If the desc is partial we have to give it back. */
-	if (new_anchor.data.state == STATE_PARTIAL) {
-		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, desc, NULL) != NULL)
-			heap_put_partial (desc);
-	}
+	arena_end = mem + size;
+	arena_next = mem;
+	mono_memory_write_barrier ();
+	arena_start = mem;
+}
 
-	return addr;
+static gboolean
+arena_contains (gpointer p)
+{
+	return arena_start && (char*)p >= arena_start && (char*)p < arena_end;
 }
 
 static gpointer
-alloc_from_new_sb (MonoLockFreeAllocator *heap)
+arena_alloc_sb (unsigned int sb_size, int node)
 {
-	unsigned int slot_size, count, i;
-	Descriptor *desc = desc_alloc ();
+	char *old_next, *start;
 
-	desc->sb = alloc_sb (desc);
+	start = (char*)sb_stack_pop (&arena_free_sbs [node + 1][sb_bin_for_size (sb_size)]);
+	if (start)
+		return start;
 
-	slot_size = desc->slot_size = heap->sc->slot_size;
-	count = SB_USABLE_SIZE / slot_size;
+	do {
+		old_next = arena_next;
+		start = (char*)(((gulong)old_next + sb_size - 1) & ~(gulong)(sb_size - 1));
+		if (start + sb_size > arena_end)
+			return NULL;
+	} while (InterlockedCompareExchangePointer ((gpointer * volatile)&arena_next, start + sb_size, old_next) != old_next);
 
-	/* Organize blocks into linked list. */
-	for (i = 1; i < count - 1; ++i)
-		*(unsigned int*)((char*)desc->sb + i * slot_size) = i + 1;
+	/* The alignment gap is committed, too, so that the range stays contiguous. */
+	mono_mprotect (old_next, start + sb_size - old_next, MONO_MMAP_READ | MONO_MMAP_WRITE);
+#ifdef MADV_HUGEPAGE
+	if (sb_size == SB_HUGE_SIZE)
+		madvise (start, sb_size, MADV_HUGEPAGE);
+#endif
+	return start;
+}
 
-	desc->heap = heap;
-	/*
-	 * Setting avail to 1 because 0 is the block we're allocating
-	 * right away.
-	 */
-	desc->anchor.data.avail = 1;
-	desc->slot_size = heap->sc->slot_size;
-	desc->max_count = count;
+static void
+arena_free_sb (gpointer sb_header, unsigned int sb_size, int node)
+{
+	SBCacheEntry *entry = sb_header;
 
-	desc->anchor.data.count = desc->max_count - 1;
-	desc->anchor.data.state = STATE_PARTIAL;
+	madvise (sb_header, sb_size, MADV_DONTNEED);
+	entry->sb_size = sb_size;
+	entry->node = node;
+	sb_stack_push (&arena_free_sbs [node + 1][sb_bin_for_size (sb_size)], entry);
+}
 
-	mono_memory_write_barrier ();
+static void
+sb_release (gpointer sb_header)
+{
+	SBCacheEntry *entry = sb_header;
+	if (arena_contains (sb_header))
+		arena_free_sb (sb_header, entry->sb_size, entry->node);
+	else
+		mono_sgen_free_os_memory (sb_header, entry->sb_size);
+}
 
-	/* Make it active or free it again. */
-	if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, desc, NULL) == NULL) {
-		return desc->sb;
-	} else {
-		desc->anchor.data.state = STATE_EMPTY;
-		desc_retire (desc);
+static void
+sb_cache_trim (SBStack *cache, gint32 max_count)
+{
+	SBCacheEntry *entry;
+
+	while (cache->count > max_count && (entry = sb_stack_pop (cache)))
+		mono_thread_hazardous_try_free (entry, sb_release);
+}
+
+static void
+sb_cache_push (gpointer sb_header)
+{
+	SBCacheEntry *entry = sb_header;
+	SBStack *cache = &sb_caches [entry->node + 1][sb_bin_for_size (entry->sb_size)];
+
+	if (sb_stack_push (cache, entry) > sb_cache_high_bytes / entry->sb_size)
+		sb_cache_trim (cache, sb_cache_low_bytes / entry->sb_size);
+}
+
+void
+mono_lock_free_allocator_set_sb_cache_watermarks (size_t low_bytes, size_t high_bytes)
+{
+	g_assert (low_bytes <= high_bytes);
+	sb_cache_low_bytes = low_bytes;
+	sb_cache_high_bytes = high_bytes;
+}
+
+/* Returns NULL if the OS has no memory for us. */
+static gpointer
+alloc_sb (unsigned int sb_size, int node)
+{
+	gpointer sb_header = sb_stack_pop (&sb_caches [node + 1][sb_bin_for_size (sb_size)]);
+
+	if (!sb_header) {
+		if (arena_start)
+			sb_header = arena_alloc_sb (sb_size, node);
+		if (!sb_header) {
+			if (sb_size == SB_HUGE_SIZE)
+				sb_header = mono_sgen_alloc_os_memory_huge (SB_HUGE_SIZE);
+			else
+				sb_header = mono_sgen_try_alloc_os_memory_aligned (sb_size, sb_size, TRUE);
+			if (!sb_header)
+				return NULL;
+		}
+		if (node >= 0)
+			numa_bind (sb_header, sb_size, node);
+	}
+	g_assert (sb_header == SB_HEADER_FOR_ADDR (sb_header, sb_size));
+	return sb_header;
+}
+
+/* Makes the superblock desc's and returns the address of its first slot. */
+static gpointer
+register_sb (Descriptor *desc, gpointer sb_header, unsigned int slot_alignment)
+{
+	/* Not used for lookups, but handy when debugging. */
+	*(Descriptor**)sb_header = desc;
+	pagemap_set (sb_header, desc->sb_size, desc);
+	//g_print ("sb %p for %p\n", sb_header, desc);
+	return (char*)sb_header + SB_SLOTS_OFFSET (slot_alignment);
+}
+
+static void
+free_sb (Descriptor *desc)
+{
+	gpointer sb_header = SB_HEADER_FOR_ADDR (desc->sb, desc->sb_size);
+	g_assert ((char*)desc->sb - (char*)sb_header >= SB_HEADER_SIZE);
+	pagemap_set (sb_header, desc->sb_size, NULL);
+	((SBCacheEntry*)sb_header)->sb_size = desc->sb_size;
+	((SBCacheEntry*)sb_header)->node = desc->numa_node;
+	sb_stack_push_when_safe (sb_header, sb_cache_push);
+	//g_print ("free sb %p\n", sb_header);
+}
+
+/*
+ * Objects too big for any size class get a span of their own: a
+ * mapping of a multiple of the pagemap granule, aligned to it, with a
+ * header holding its size and the object's offset, which is 16 bytes
+ * unless the object needs stricter alignment.  We register the
+ * granule the object starts in with the header's address tagged with
+ * LARGE_SPAN_TAG, so that mono_lock_free_free () can tell spans from
+ * superblock slots.
+ *
+ * Freed spans up to LARGE_CACHE_MAX_SIZE are kept in a small cache so
+ * that repeatedly allocating big buffers doesn't go to the kernel
+ * every time.  Span sizes are rounded up to one of four steps per
+ * power of two, which gives us few enough bins that a span of the
+ * right size is likely to be found.  The limit applies to the rounded
+ * size, and is the step that a 1 MB object and its header round to.  Caching uses the same stacks as
+ * the superblock cache, and the same rules for hazard pointers apply.
+ */
+typedef struct {
+	size_t size;
+	size_t offset;
+} LargeSpan;
+
+#define LARGE_SPAN_TAG		1
+#define IS_LARGE_SPAN(d)	((gulong)(d) & LARGE_SPAN_TAG)
+#define LARGE_SPAN_FOR_DESC(d)	((LargeSpan*)((gulong)(d) & ~(gulong)LARGE_SPAN_TAG))
+
+#define LARGE_GRANULE		(1 << PAGEMAP_SHIFT)
+#define LARGE_CACHE_MAX_SIZE	(80 * LARGE_GRANULE)
+#define LARGE_CACHE_NUM_BINS	21
+#define LARGE_CACHE_BIN_COUNT	4
+
+static SBStack large_caches [LARGE_CACHE_NUM_BINS];
+
+/*
+ * Rounds *size up to the size of the span we use for it and returns
+ * its cache bin, or -1 if spans that big are not cached.
+ */
+static int
+large_span_size (size_t *size)
+{
+	size_t granules = (*size + LARGE_GRANULE - 1) / LARGE_GRANULE;
+	size_t rounded = granules;
+	int shift = 0;
+
+	if (granules > 8) {
+		while (((granules - 1) >> shift) >= 8)
+			++shift;
+		rounded = (((granules - 1) >> shift) + 1) << shift;
+	}
+
+	if (rounded > LARGE_CACHE_MAX_SIZE / LARGE_GRANULE) {
+		*size = granules * LARGE_GRANULE;
+		return -1;
+	}
+
+	*size = rounded * LARGE_GRANULE;
+	if (granules <= 8)
+		return granules - 1;
+	return 8 + (shift - 1) * 4 + (rounded >> shift) - 5;
+}
+
+static void
+large_cache_push (gpointer span)
+{
+	SBCacheEntry *entry = span;
+	size_t size = entry->sb_size;
+	SBStack *cache = &large_caches [large_span_size (&size)];
+
+	if (sb_stack_push (cache, entry) > LARGE_CACHE_BIN_COUNT && (entry = sb_stack_pop (cache)))
+		mono_thread_hazardous_try_free (entry, sb_release);
+}
+
+/*
+ * Spans for objects aligned to more than the granule must be aligned
+ * stricter than cached spans are, so they are never cached.
+ */
+#define LARGE_SPAN_CACHEABLE(size,offset)	((size) <= LARGE_CACHE_MAX_SIZE && (offset) <= LARGE_GRANULE)
+
+#define LARGE_GRANULE_FOR_ADDR(a)	((gpointer)((gulong)(a) & ~(gulong)(LARGE_GRANULE - 1)))
+
+gpointer
+mono_lock_free_alloc_large_aligned (size_t size, size_t alignment)
+{
+	size_t offset = MAX (alignment, SB_HEADER_SIZE);
+	LargeSpan *span = NULL;
+	char *ptr;
+	int bin;
+
+	g_assert (!(alignment & (alignment - 1)));
+
+	if (size > ((size_t)-1) / 2 - offset)
 		return NULL;
+
+	size += offset;
+	bin = large_span_size (&size);
+
+	if (bin >= 0 && LARGE_SPAN_CACHEABLE (size, offset))
+		span = (LargeSpan*)sb_stack_pop (&large_caches [bin]);
+	if (!span)
+		span = mono_sgen_try_alloc_os_memory_aligned (size, MAX (alignment, LARGE_GRANULE), TRUE);
+	if (!span)
+		return NULL;
+
+	span->size = size;
+	span->offset = offset;
+	ptr = (char*)span + offset;
+	pagemap_set (LARGE_GRANULE_FOR_ADDR (ptr), LARGE_GRANULE, (Descriptor*)((gulong)span | LARGE_SPAN_TAG));
+	return ptr;
+}
+
+gpointer
+mono_lock_free_alloc_large (size_t size)
+{
+	return mono_lock_free_alloc_large_aligned (size, 0);
+}
+
+static void
+free_large (Descriptor *desc, gpointer ptr)
+{
+	LargeSpan *span = LARGE_SPAN_FOR_DESC (desc);
+	size_t size = span->size;
+
+	g_assert ((char*)span + span->offset == ptr);
+	pagemap_set (LARGE_GRANULE_FOR_ADDR (ptr), LARGE_GRANULE, NULL);
+
+	if (!LARGE_SPAN_CACHEABLE (size, span->offset)) {
+		/* Spans we don't cache are never on a stack, so no hazard pointer can refer to them. */
+		mono_sgen_free_os_memory (span, size);
+		return;
+	}
+
+	((SBCacheEntry*)span)->sb_size = size;
+	sb_stack_push_when_safe (span, large_cache_push);
+}
+
+/*
+ * Picks the smallest superblock size that holds at least SB_MIN_SLOTS
+ * slots and doesn't waste more than 1/SB_MAX_WASTE of itself on the
+ * tail that's too small for a slot and on alignment padding.  With
+ * huge pages we always use SB_HUGE_SIZE, unless the slot count
+ * wouldn't fit into the anchor.
+ */
+#define SB_MIN_SLOTS	8
+#define SB_MAX_WASTE	32
+
+static unsigned int
+choose_sb_size (unsigned int slot_size, unsigned int slot_alignment, gboolean huge_pages)
+{
+	unsigned int sb_size;
+
+	if (huge_pages && SB_SLOTS_SIZE (SB_HUGE_SIZE, slot_alignment) / slot_size <= ANCHOR_MAX_COUNT)
+		return SB_HUGE_SIZE;
+
+	for (sb_size = SB_MIN_SIZE; sb_size < SB_MAX_SIZE; sb_size *= 2) {
+		unsigned int count = SB_SLOTS_SIZE (sb_size, slot_alignment) / slot_size;
+		unsigned int waste = SB_USABLE_SIZE (sb_size) - count * slot_size;
+
+		if (count >= SB_MIN_SLOTS && waste <= sb_size / SB_MAX_WASTE)
+			break;
+		if (SB_SLOTS_SIZE (sb_size * 2, slot_alignment) / slot_size > ANCHOR_MAX_COUNT)
+			break;
+	}
+
+	return sb_size;
+}
+
+#ifndef DESC_AVAIL_DUMMY
+/*
+ * Descriptors come from slabs, which are aligned to their size, so
+ * that we can get from a descriptor to its slab by masking.  A slab
+ * is managed like a superblock: it has an anchor with the chain of its
+ * free descriptors, and slabs with free descriptors are kept on a
+ * partial stack, which works like the superblock cache's.  An
+ * allocation pops a slab and takes a batch of descriptors from it with
+ * one CAS, then pushes the slab back unless it is FULL.  Returning a
+ * descriptor pushes it onto its slab's chain, and whoever makes a FULL
+ * slab PARTIAL or EMPTY pushes it back onto the stack.  Since a slab's
+ * memory isn't reused while the slab is alive, the chain needs no
+ * hazard pointers, only the anchor's tag.
+ *
+ * An EMPTY slab that's popped is unmapped, unless it's the only slab
+ * left, which keeps us from mapping and unmapping a slab over and
+ * over.  The stack entry is at the start of the slab, so the slab is
+ * unmapped only once no hazard pointer from a pop refers to it.
+ *
+ * Every thread has a small cache of descriptors in front of the slabs,
+ * which is refilled and flushed in batches.  Like the malloc thread
+ * caches, the caches of exited threads are orphaned and flushed by the
+ * next refill.
+ */
+#define DESC_SLAB_SIZE		(32 * 1024)
+#define DESC_SLAB_FOR_DESC(d)	((DescSlab*)((gulong)(d) & ~(gulong)(DESC_SLAB_SIZE - 1)))
+#define DESC_SLAB_DESCS(s)	((Descriptor*)((char*)(s) + DESC_SLAB_HEADER_SIZE))
+#define DESC_SLAB_HEADER_SIZE	64
+#define DESCS_PER_SLAB		((DESC_SLAB_SIZE - DESC_SLAB_HEADER_SIZE) / sizeof (Descriptor))
+
+typedef union {
+	gint32 value;
+	struct {
+		guint32 avail : 10;
+		guint32 count : 10;
+		guint32 state : 2;
+		guint32 tag : 10;
+	} data;
+} SlabAnchor;
+
+typedef struct {
+	SBCacheEntry entry;	/* must be first, see above */
+	volatile SlabAnchor anchor;
+} DescSlab;
+
+static SBStack desc_slab_partial;
+
+#define DESC_CACHE_SIZE	16
+
+typedef struct _DescCache DescCache;
+struct _DescCache {
+	DescCache *next;
+	int count;
+	Descriptor *descs [DESC_CACHE_SIZE];
+};
+
+static pthread_key_t desc_cache_key;
+static pthread_once_t desc_slabs_once = PTHREAD_ONCE_INIT;
+static DescCache * volatile orphaned_desc_caches;
+
+static void
+desc_slab_release (gpointer slab)
+{
+	mono_sgen_free_os_memory (slab, DESC_SLAB_SIZE);
+}
+
+static void
+desc_slab_put_partial (gpointer _slab)
+{
+	DescSlab *slab = _slab;
+
+	sb_stack_push (&desc_slab_partial, &slab->entry);
+}
+
+static DescSlab*
+desc_slab_get_partial (void)
+{
+	return (DescSlab*)sb_stack_pop (&desc_slab_partial);
+}
+
+/* Maps a new slab and takes the first n of its descriptors. */
+static int
+desc_slab_alloc_new (Descriptor **out, int n)
+{
+	DescSlab *slab = mono_sgen_alloc_os_memory_aligned (DESC_SLAB_SIZE, DESC_SLAB_SIZE, TRUE);
+	Descriptor *descs = DESC_SLAB_DESCS (slab);
+	int i;
+
+	g_assert (sizeof (DescSlab) <= DESC_SLAB_HEADER_SIZE);
+	g_assert (DESCS_PER_SLAB < (1 << 10) && n < DESCS_PER_SLAB);
+
+	for (i = 0; i < DESCS_PER_SLAB; ++i) {
+		mono_lock_free_queue_node_init (&descs [i].node, TRUE);
+		descs [i].slab_next = i + 1 < DESCS_PER_SLAB ? i + 1 : 0;
+		if (i < n)
+			out [i] = &descs [i];
+	}
+
+	slab->anchor.data.avail = n;
+	slab->anchor.data.count = DESCS_PER_SLAB - n;
+	slab->anchor.data.state = STATE_PARTIAL;
+	slab->anchor.data.tag = 0;
+
+	mono_memory_write_barrier ();
+
+	desc_slab_put_partial (slab);
+
+	return n;
+}
+
+/* Takes up to n descriptors from one slab. */
+static int
+desc_slab_alloc (Descriptor **out, int n)
+{
+	SlabAnchor old_anchor, new_anchor;
+	DescSlab *slab;
+	int i, k;
+
+ retry:
+	slab = desc_slab_get_partial ();
+	if (!slab)
+		return desc_slab_alloc_new (out, n);
+
+	/* We own the slab now, and only frees can change its anchor. */
+	if (slab->anchor.data.state == STATE_EMPTY && desc_slab_partial.count > 0) {
+		mono_thread_hazardous_try_free (slab, desc_slab_release);
+		goto retry;
+	}
+
+	do {
+		Descriptor *descs = DESC_SLAB_DESCS (slab);
+		unsigned int next;
+
+		new_anchor = old_anchor = *(volatile SlabAnchor*)&slab->anchor.value;
+		g_assert (old_anchor.data.state != STATE_FULL);
+
+		mono_memory_read_barrier ();
+
+		/* As with superblocks, frees only push, so this part of the chain is stable. */
+		k = MIN (n, old_anchor.data.count);
+		next = old_anchor.data.avail;
+		for (i = 0; i < k; ++i) {
+			g_assert (next < DESCS_PER_SLAB);
+			out [i] = &descs [next];
+			next = descs [next].slab_next;
+		}
+
+		new_anchor.data.avail = next;
+		new_anchor.data.count -= k;
+		new_anchor.data.state = new_anchor.data.count ? STATE_PARTIAL : STATE_FULL;
+		++new_anchor.data.tag;
+	} while (InterlockedCompareExchange (&slab->anchor.value, new_anchor.value, old_anchor.value) != old_anchor.value);
+
+	if (new_anchor.data.state == STATE_PARTIAL)
+		sb_stack_push_when_safe (slab, desc_slab_put_partial);
+
+	return k;
+}
+
+static void
+desc_slab_free (Descriptor *desc)
+{
+	DescSlab *slab = DESC_SLAB_FOR_DESC (desc);
+	unsigned int index = desc - DESC_SLAB_DESCS (slab);
+	SlabAnchor old_anchor, new_anchor;
+
+	do {
+		new_anchor = old_anchor = *(volatile SlabAnchor*)&slab->anchor.value;
+
+		desc->slab_next = old_anchor.data.avail;
+		mono_memory_write_barrier ();
+
+		new_anchor.data.avail = index;
+		++new_anchor.data.count;
+		new_anchor.data.state = new_anchor.data.count == DESCS_PER_SLAB ? STATE_EMPTY : STATE_PARTIAL;
+		++new_anchor.data.tag;
+	} while (InterlockedCompareExchange (&slab->anchor.value, new_anchor.value, old_anchor.value) != old_anchor.value);
+
+	/* A FULL slab isn't in the queue, so it's ours to put back. */
+	if (old_anchor.data.state == STATE_FULL)
+		sb_stack_push_when_safe (slab, desc_slab_put_partial);
+}
+
+static void
+desc_cache_flush (DescCache *cache, int n)
+{
+	g_assert (n <= cache->count);
+
+	while (n-- > 0)
+		desc_slab_free (cache->descs [--cache->count]);
+}
+
+static void
+desc_cache_orphan (gpointer _cache)
+{
+	DescCache *cache = _cache;
+	DescCache *old_head;
+
+	do {
+		old_head = orphaned_desc_caches;
+		cache->next = old_head;
+		mono_memory_write_barrier ();
+	} while (InterlockedCompareExchangePointer ((gpointer * volatile)&orphaned_desc_caches, cache, old_head) != old_head);
+}
+
+static void
+flush_orphaned_desc_caches (void)
+{
+	DescCache *cache;
+
+	if (!orphaned_desc_caches)
+		return;
+
+	cache = InterlockedExchangePointer ((gpointer * volatile)&orphaned_desc_caches, NULL);
+	while (cache) {
+		DescCache *next = cache->next;
+		desc_cache_flush (cache, cache->count);
+		mono_sgen_free_os_memory (cache, sizeof (DescCache));
+		cache = next;
+	}
+}
+
+static void
+desc_slabs_init (void)
+{
+	pthread_key_create (&desc_cache_key, desc_cache_orphan);
+}
+
+static DescCache*
+desc_cache_get (void)
+{
+	DescCache *cache;
+
+	pthread_once (&desc_slabs_once, desc_slabs_init);
+	cache = pthread_getspecific (desc_cache_key);
+	if (!cache) {
+		cache = mono_sgen_alloc_os_memory (sizeof (DescCache), TRUE);
+		pthread_setspecific (desc_cache_key, cache);
+	}
+	return cache;
+}
+
+static Descriptor*
+desc_alloc (void)
+{
+	DescCache *cache = desc_cache_get ();
+	Descriptor *desc;
+
+	if (!cache->count) {
+		flush_orphaned_desc_caches ();
+		cache->count = desc_slab_alloc (cache->descs, DESC_CACHE_SIZE / 2);
+	}
+	desc = cache->descs [--cache->count];
+
+	g_assert (!desc->in_use);
+	desc->in_use = TRUE;
+
+	return desc;
+}
+
+static void
+desc_enqueue_avail (gpointer _desc)
+{
+	Descriptor *desc = _desc;
+	DescCache *cache = desc_cache_get ();
+
+	g_assert (desc->anchor.data.state == STATE_EMPTY);
+	g_assert (!desc->in_use);
+
+	if (cache->count == DESC_CACHE_SIZE)
+		desc_cache_flush (cache, DESC_CACHE_SIZE / 2);
+	cache->descs [cache->count++] = desc;
+}
+
+static void
+desc_retire (Descriptor *desc)
+{
+	g_assert (desc->anchor.data.state == STATE_EMPTY);
+	g_assert (desc->in_use);
+	desc->in_use = FALSE;
+	STAT_ADD (desc->stats_index, retires, 1);
+	free_sb (desc);
+	mono_thread_hazardous_free_or_queue (desc, desc_enqueue_avail, FALSE, TRUE);
+}
+
+/*
+ * Gives the calling thread's cached descriptors back to their slabs
+ * and unmaps the slabs that are EMPTY.
+ */
+static void
+trim_desc_slabs (void)
+{
+	int n = desc_slab_partial.count;
+	DescCache *cache = desc_cache_get ();
+	DescSlab *slab, *kept = NULL;
+
+	desc_cache_flush (cache, cache->count);
+	flush_orphaned_desc_caches ();
+
+	while (n-- > 0 && (slab = desc_slab_get_partial ())) {
+		if (slab->anchor.data.state == STATE_EMPTY) {
+			mono_thread_hazardous_try_free (slab, desc_slab_release);
+		} else {
+			/* If we pushed it back right away we'd pop it again. */
+			slab->entry.next = (SBCacheEntry*)kept;
+			kept = slab;
+		}
+	}
+
+	while (kept) {
+		slab = kept;
+		kept = (DescSlab*)slab->entry.next;
+		sb_stack_push_when_safe (slab, desc_slab_put_partial);
+	}
+}
+#else
+MonoLockFreeQueue available_descs;
+
+static Descriptor*
+desc_alloc (void)
+{
+	Descriptor *desc = (Descriptor*)mono_lock_free_queue_dequeue (&available_descs);
+
+	if (desc)
+		return desc;
+
+	return calloc (1, sizeof (Descriptor));
+}
+
+static void
+desc_retire (Descriptor *desc)
+{
+	free_sb (desc);
+	mono_lock_free_queue_enqueue (&available_descs, &desc->node);
+}
+
+static void
+trim_desc_slabs (void)
+{
+}
+#endif
+
+/*
+ * The partial superblocks of a size class are kept in the FIFO queue,
+ * or in Treiber stacks, for the LIFO and the fullest first policies.
+ * LIFO only uses the first stack.  Fullest first puts a descriptor
+ * into the stack for its occupancy when it's put back, which is only
+ * approximate because frees go on while it sits there.
+ */
+#define PARTIAL_USES_BINS(sc)	((sc)->flags & (MONO_LOCK_FREE_ALLOC_PARTIAL_LIFO | MONO_LOCK_FREE_ALLOC_PARTIAL_FULLEST_FIRST))
+
+static int
+partial_bin_for_desc (Descriptor *desc)
+{
+	unsigned int used;
+
+	if (!(desc->heap->sc->flags & MONO_LOCK_FREE_ALLOC_PARTIAL_FULLEST_FIRST))
+		return 0;
+	used = desc->max_count - desc->anchor.data.count - desc->trimmed;
+	return MIN (used * MONO_LOCK_FREE_ALLOC_PARTIAL_BINS / desc->max_count, MONO_LOCK_FREE_ALLOC_PARTIAL_BINS - 1);
+}
+
+#ifdef TAGGED_PARTIAL
+/*
+ * On x86-64 the queue and the stacks don't link descriptors, but
+ * partial nodes, which point to them.  Nodes are never unmapped, only
+ * recycled through their size class's free stack, so a thread holding
+ * on to a stale node reads garbage but doesn't fault.
+ *
+ * The stacks, i.e. the bins and the free stacks, keep a count of
+ * their operations next to the top, and we swap both with
+ * cmpxchg16b, so a pop with a stale top fails.  The queue is Michael
+ * and Scott's with counted pointers: every word that points to a node
+ * carries a 20 bit tag, in its upper 16 bits and in the low 4 bits
+ * that the 16 byte alignment of nodes leaves free, which is
+ * incremented with every write, so a CAS with a stale value fails.
+ * The next words of nodes are tagged the same way while they're on a
+ * stack, so that a stale enqueue can't link to a recycled node.
+ *
+ * This way a descriptor can be put back right away, without a scan of
+ * the hazard pointers of all threads, which is what we'd need before
+ * linking its embedded node again.
+ */
+typedef struct _PartialNode PartialNode;
+struct _PartialNode {
+	volatile gint64 next;	/* tagged */
+	Descriptor *desc;
+};
+
+#define TAG_SHIFT		48
+#define TAG_LOW_BITS		4
+#define TAG_LOW_MASK		(((guint64)1 << TAG_LOW_BITS) - 1)
+#define TAGGED_PTR(t)		((PartialNode*)((guint64)(t) & (((guint64)1 << TAG_SHIFT) - 1) & ~TAG_LOW_MASK))
+#define TAG_OF(t)		((((guint64)(t) >> TAG_SHIFT) << TAG_LOW_BITS) | ((guint64)(t) & TAG_LOW_MASK))
+/* The tagged pointer that replaces t, pointing to p. */
+#define TAGGED_NEXT(t,p)	((gint64)(((TAG_OF (t) + 1) >> TAG_LOW_BITS) << TAG_SHIFT | ((TAG_OF (t) + 1) & TAG_LOW_MASK) | (gulong)(p)))
+
+#define PARTIAL_NODE_BATCH	(4096 / sizeof (PartialNode))
+
+static void
+node_stack_push (MonoLockFreeAllocNodeStack *stack, PartialNode *node)
+{
+	gint64 count;
+	PartialNode *top;
+
+	do {
+		count = stack->count;
+		top = stack->top;
+		node->next = TAGGED_NEXT (node->next, top);
+		mono_memory_write_barrier ();
+	} while (!atomic128_cmpxchg ((volatile gint64*)stack, (gint64)top, count, (gint64)node, count + 1));
+}
+
+static PartialNode*
+node_stack_pop (MonoLockFreeAllocNodeStack *stack)
+{
+	gint64 count;
+	PartialNode *top;
+
+	do {
+		/* The count first, so that a top that changed since makes the CAS fail. */
+		count = stack->count;
+		top = stack->top;
+		if (!top)
+			return NULL;
+	} while (!atomic128_cmpxchg ((volatile gint64*)stack, (gint64)top, count, (gint64)TAGGED_PTR (top->next), count + 1));
+
+	return top;
+}
+
+static PartialNode*
+partial_node_alloc (MonoLockFreeAllocSizeClass *sc, Descriptor *desc)
+{
+	PartialNode *node = node_stack_pop (&sc->partial_node_free);
+
+	if (!node) {
+		/* Nobody sees the new nodes before we push them, so losing a race can't waste them. */
+		PartialNode *nodes = mono_sgen_alloc_os_memory (PARTIAL_NODE_BATCH * sizeof (PartialNode), TRUE);
+		int i;
+
+		g_assert (sizeof (PartialNode) == 1 << TAG_LOW_BITS && nodes);
+		for (i = 1; i < PARTIAL_NODE_BATCH; ++i)
+			node_stack_push (&sc->partial_node_free, &nodes [i]);
+		node = &nodes [0];
+	}
+
+	node->desc = desc;
+	return node;
+}
+
+static void
+partial_queue_init (MonoLockFreeAllocSizeClass *sc)
+{
+	PartialNode *dummy;
+
+	memset ((gpointer)&sc->partial_node_free, 0, sizeof (sc->partial_node_free));
+	memset ((gpointer)sc->partial_bins, 0, sizeof (sc->partial_bins));
+
+	dummy = partial_node_alloc (sc, NULL);
+	dummy->next = TAGGED_NEXT (dummy->next, NULL);
+	sc->partial_head = sc->partial_tail = TAGGED_NEXT (0, dummy);
+}
+
+static void
+partial_queue_enqueue (MonoLockFreeAllocSizeClass *sc, Descriptor *desc)
+{
+	PartialNode *node = partial_node_alloc (sc, desc);
+	gint64 tail, next;
+
+	node->next = TAGGED_NEXT (node->next, NULL);
+	mono_memory_write_barrier ();
+
+	for (;;) {
+		tail = atomic64_read (&sc->partial_tail);
+		next = TAGGED_PTR (tail)->next;
+		if (tail != sc->partial_tail)
+			continue;
+		if (!TAGGED_PTR (next)) {
+			if (atomic64_cmpxchg (&TAGGED_PTR (tail)->next, next, TAGGED_NEXT (next, node)) == next)
+				break;
+		} else {
+			/* The tail is lagging behind. */
+			atomic64_cmpxchg (&sc->partial_tail, tail, TAGGED_NEXT (tail, TAGGED_PTR (next)));
+		}
+	}
+	atomic64_cmpxchg (&sc->partial_tail, tail, TAGGED_NEXT (tail, node));
+}
+
+static Descriptor*
+partial_queue_dequeue (MonoLockFreeAllocSizeClass *sc)
+{
+	gint64 head, tail, next;
+	Descriptor *desc;
+
+	for (;;) {
+		head = atomic64_read (&sc->partial_head);
+		tail = atomic64_read (&sc->partial_tail);
+		next = TAGGED_PTR (head)->next;
+		if (head != sc->partial_head)
+			continue;
+		if (TAGGED_PTR (head) == TAGGED_PTR (tail)) {
+			if (!TAGGED_PTR (next))
+				return NULL;
+			atomic64_cmpxchg (&sc->partial_tail, tail, TAGGED_NEXT (tail, TAGGED_PTR (next)));
+		} else if (TAGGED_PTR (next)) {
+			/* The new head's descriptor must be read before another dequeue frees the node. */
+			desc = TAGGED_PTR (next)->desc;
+			if (atomic64_cmpxchg (&sc->partial_head, head, TAGGED_NEXT (head, TAGGED_PTR (next))) == head)
+				break;
+		}
+	}
+
+	/* The old head was the dummy, the new one takes its place. */
+	node_stack_push (&sc->partial_node_free, TAGGED_PTR (head));
+	return desc;
+}
+
+static void
+partial_push (MonoLockFreeAllocSizeClass *sc, Descriptor *desc)
+{
+	if (PARTIAL_USES_BINS (sc))
+		node_stack_push (&sc->partial_bins [partial_bin_for_desc (desc)], partial_node_alloc (sc, desc));
+	else
+		partial_queue_enqueue (sc, desc);
+}
+
+/* Pops from the fullest bin first, or from the emptiest. */
+static Descriptor*
+partial_pop (MonoLockFreeAllocSizeClass *sc, gboolean fullest_first)
+{
+	int i;
+
+	if (!PARTIAL_USES_BINS (sc))
+		return partial_queue_dequeue (sc);
+
+	for (i = 0; i < MONO_LOCK_FREE_ALLOC_PARTIAL_BINS; ++i) {
+		PartialNode *node = node_stack_pop (&sc->partial_bins [fullest_first ? MONO_LOCK_FREE_ALLOC_PARTIAL_BINS - 1 - i : i]);
+		if (node) {
+			Descriptor *desc = node->desc;
+			node_stack_push (&sc->partial_node_free, node);
+			return desc;
+		}
+	}
+	return NULL;
+}
+#else
+/*
+ * Elsewhere we link the descriptors themselves.  Pops protect the top
+ * of a stack with a hazard pointer.  Pushes only happen in
+ * desc_put_partial (), which is delayed while the descriptor is
+ * hazardous, so the top can't be popped and pushed again under us, and
+ * there's no ABA problem.  The same delay makes it safe to enqueue a
+ * descriptor's node again.
+ */
+static void
+partial_queue_init (MonoLockFreeAllocSizeClass *sc)
+{
+	mono_lock_free_queue_init (&sc->partial);
+	memset ((gpointer)sc->partial_bins, 0, sizeof (sc->partial_bins));
+}
+
+static void
+partial_push (MonoLockFreeAllocSizeClass *sc, Descriptor *desc)
+{
+	Descriptor * volatile *top;
+	Descriptor *old_top;
+
+	if (!PARTIAL_USES_BINS (sc)) {
+		mono_lock_free_queue_node_free (&desc->node);
+		mono_lock_free_queue_enqueue (&sc->partial, &desc->node);
+		return;
+	}
+
+	top = &sc->partial_bins [partial_bin_for_desc (desc)];
+	do {
+		old_top = *top;
+		desc->partial_next = old_top;
+		mono_memory_write_barrier ();
+	} while (InterlockedCompareExchangePointer ((gpointer * volatile)top, desc, old_top) != old_top);
+}
+
+/* Pops from the fullest bin first, or from the emptiest. */
+static Descriptor*
+partial_pop (MonoLockFreeAllocSizeClass *sc, gboolean fullest_first)
+{
+	MonoThreadHazardPointers *hp;
+	int i;
+
+	if (!PARTIAL_USES_BINS (sc))
+		return (Descriptor*)mono_lock_free_queue_dequeue (&sc->partial);
+
+	hp = mono_hazard_pointer_get ();
+	for (i = 0; i < MONO_LOCK_FREE_ALLOC_PARTIAL_BINS; ++i) {
+		Descriptor * volatile *top = &sc->partial_bins [fullest_first ? MONO_LOCK_FREE_ALLOC_PARTIAL_BINS - 1 - i : i];
+		Descriptor *desc;
+
+		for (;;) {
+			desc = get_hazardous_pointer ((gpointer * volatile)top, hp, 1);
+			if (!desc)
+				break;
+			if (InterlockedCompareExchangePointer ((gpointer * volatile)top, desc->partial_next, desc) == desc)
+				break;
+			mono_hazard_pointer_clear (hp, 1);
+		}
+
+		mono_hazard_pointer_clear (hp, 1);
+		if (desc)
+			return desc;
+	}
+	return NULL;
+}
+#endif
+
+static Descriptor*
+list_get_partial (MonoLockFreeAllocSizeClass *sc)
+{
+	for (;;) {
+		Descriptor *desc = partial_pop (sc, TRUE);
+		if (!desc)
+			return NULL;
+		InterlockedDecrement (&sc->partial_count);
+		if (desc->anchor.data.state != STATE_EMPTY)
+			return desc;
+		desc_retire (desc);
+	}
+}
+
+static void
+desc_put_partial (gpointer _desc)
+{
+	Descriptor *desc = _desc;
+
+	g_assert (desc->anchor.data.state != STATE_FULL);
+
+	partial_push (desc->heap->sc, desc);
+	InterlockedIncrement (&desc->heap->sc->partial_count);
+}
+
+static void
+list_put_partial (Descriptor *desc)
+{
+	g_assert (desc->anchor.data.state != STATE_FULL);
+#ifdef TAGGED_PARTIAL
+	desc_put_partial (desc);
+#else
+	mono_thread_hazardous_free_or_queue (desc, desc_put_partial, FALSE, TRUE);
+#endif
+}
+
+static void
+list_remove_empty_desc (MonoLockFreeAllocSizeClass *sc)
+{
+	int num_non_empty = 0;
+	for (;;) {
+		Descriptor *desc = partial_pop (sc, FALSE);
+		if (!desc)
+			return;
+		InterlockedDecrement (&sc->partial_count);
+		/*
+		 * We don't need to read atomically because we're the
+		 * only thread that references this descriptor.
+		 */
+		if (desc->anchor.data.state == STATE_EMPTY) {
+			desc_retire (desc);
+		} else {
+			g_assert (desc->heap->sc == sc);
+			list_put_partial (desc);
+			if (++num_non_empty >= 2)
+				return;
+		}
+	}
+}
+
+/*
+ * If our own node has no partial superblocks we'd have to map a new
+ * one.  Before we do, we take one from another node if it has at
+ * least NUMA_STEAL_THRESHOLD.  Remote memory is slower, but a node
+ * sitting on that many partial superblocks while another one maps new
+ * ones wastes memory.
+ */
+#define NUMA_STEAL_THRESHOLD	4
+
+static Descriptor*
+heap_get_partial (MonoLockFreeAllocator *heap)
+{
+	MonoLockFreeAllocSizeClass *sc = heap->sc;
+	MonoLockFreeAllocSizeClass *victim;
+	Descriptor *desc = list_get_partial (sc);
+
+	if (desc)
+		return desc;
+
+	for (victim = sc->numa_next; victim != sc; victim = victim->numa_next) {
+		if (victim->partial_count >= NUMA_STEAL_THRESHOLD && (desc = list_get_partial (victim)))
+			return desc;
+	}
+	return NULL;
+}
+
+static void
+heap_put_partial (Descriptor *desc)
+{
+	list_put_partial (desc);
+}
+
+/*
+ * Remote frees.  In remote-free mode, the thread that last acquired a
+ * descriptor for allocating from it is its owner.  Frees by other
+ * threads don't touch the anchor but push the slot onto the
+ * descriptor's remote free list, which is linked through pointers in
+ * the slots.  The owner reclaims the whole list with a single swap and
+ * a single anchor CAS.
+ *
+ * Remotely freed slots are still counted as allocated, so a descriptor
+ * that goes FULL must not be left with a non-empty remote list,
+ * because a FULL descriptor is not referenced by anybody and nobody
+ * would ever reclaim it.  Both sides therefore check the other after
+ * their own write: the allocator reclaims after making the descriptor
+ * FULL, and a remote free reclaims itself after pushing onto the list
+ * of a FULL descriptor.  The swap makes sure only one of them gets the
+ * list.
+ *
+ * Whichever side gets the list might free the last slots and retire
+ * the descriptor while the other one still looks at it, so both hold
+ * DESC_HAZARD on it while they do.  They set it while the descriptor
+ * can't be retired yet: the allocator before its anchor CAS makes the
+ * descriptor FULL, the remote free before pushing its slots.
+ */
+#define DESC_HAZARD	2
+
+static void reclaim_remote_frees (Descriptor *desc);
+
+static void
+desc_acquire (Descriptor *desc)
+{
+	if (desc->remote_free) {
+		pthread_t self = pthread_self ();
+		if (!pthread_equal (desc->owner, self))
+			desc->owner = self;
+	}
+}
+
+static gboolean
+set_anchor (Descriptor *desc, Anchor old_anchor, Anchor new_anchor)
+{
+	if (old_anchor.data.state == STATE_EMPTY)
+		g_assert (new_anchor.data.state == STATE_EMPTY);
+
+#ifdef ANCHOR_64
+	new_anchor.data.tag = old_anchor.data.tag + 1;
+	if (atomic64_cmpxchg (&desc->anchor.value, old_anchor.value, new_anchor.value) == old_anchor.value)
+		return TRUE;
+#else
+	if (InterlockedCompareExchange (&desc->anchor.value, new_anchor.value, old_anchor.value) == old_anchor.value)
+		return TRUE;
+#endif
+	STAT_ADD (desc->stats_index, anchor_cas_retries, 1);
+	return FALSE;
+}
+
+/*
+ * The free chain of a fresh superblock isn't written out.  Instead the
+ * slots from desc->bump on, which no one has touched yet, are linked
+ * implicitly, each to the one after it.  Frees only push slots that
+ * were handed out, i.e. below the bump, so the untouched slots are
+ * always at the end of the chain, and a superblock's pages are only
+ * faulted in as its slots get used.
+ *
+ * Only the descriptor's owner walks the chain, so the bump needs no
+ * synchronization beyond what the transfer of ownership gives us.  That
+ * means the owner must publish the new bump before the anchor CAS that
+ * can give up ownership: once the descriptor is FULL, a free can hand
+ * it to a new owner right away, which must not see a stale bump.  The
+ * owner therefore walks the chain with the bump it read when it took
+ * the descriptor, and stores the raised one before each CAS attempt.
+ * If the CAS fails we still own the descriptor, and nobody looks at
+ * the bump before we try again.
+ */
+static unsigned int
+chain_next (Descriptor *desc, unsigned int bump, unsigned int index)
+{
+	if (index >= bump)
+		return index + 1 < desc->max_count ? index + 1 : 0;
+	return *(unsigned int*)((char*)desc->sb + index * desc->slot_size);
+}
+
+/*
+ * Allocates up to n slots, all from one descriptor, with a single CAS
+ * on its anchor.  Returns the number of slots allocated, which is zero
+ * if there is neither an active nor a partial descriptor.
+ */
+static int
+alloc_from_active_or_partial (MonoLockFreeAllocator *heap, gpointer *out, int n)
+{
+	Descriptor *desc;
+	Anchor old_anchor, new_anchor;
+	unsigned int old_bump, bump;
+	int i, k, stats_index;
+
+ retry:
+	desc = heap->active;
+	if (desc) {
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, NULL, desc) != desc)
+			goto retry;
+	} else {
+		desc = heap_get_partial (heap);
+		if (!desc)
+			return 0;
+		desc->heap = heap;
+		if (desc->remote_free)
+			reclaim_remote_frees (desc);
+	}
+
+	/* Now we own the desc. */
+	desc_acquire (desc);
+	stats_index = desc->stats_index;
+	old_bump = desc->bump;
+	if (desc->remote_free)
+		mono_hazard_pointer_set (mono_hazard_pointer_get (), DESC_HAZARD, desc);
+
+	do {
+		unsigned int next;
+
+		new_anchor = old_anchor = *(volatile Anchor*)&desc->anchor.value;
+		if (old_anchor.data.state == STATE_EMPTY) {
+			/* We must free it because we own it. */
+			desc_retire (desc);
+			if (desc->remote_free)
+				mono_hazard_pointer_clear (mono_hazard_pointer_get (), DESC_HAZARD);
+			goto retry;
+		}
+		g_assert (old_anchor.data.state == STATE_PARTIAL);
+		g_assert (old_anchor.data.count > 0);
+
+		mono_memory_read_barrier ();
+
+		/*
+		 * Frees only ever push onto the front of the chain,
+		 * and we're the only allocator, so the first count
+		 * slots of the chain can't change under us.
+		 */
+		k = MIN (n, old_anchor.data.count);
+		next = old_anchor.data.avail;
+		bump = old_bump;
+		for (i = 0; i < k; ++i) {
+			out [i] = (char*)desc->sb + next * desc->slot_size;
+			if (next >= bump)
+				bump = next + 1;
+			next = chain_next (desc, old_bump, next);
+			g_assert (next < desc->max_count);
+		}
+
+		new_anchor.data.avail = next;
+		new_anchor.data.count -= k;
+
+		if (new_anchor.data.count == 0)
+			new_anchor.data.state = STATE_FULL;
+
+		desc->bump = bump;
+	} while (!set_anchor (desc, old_anchor, new_anchor));
+
+	STAT_ADD (stats_index, allocs, k);
+
+	/* If the desc is partial we have to give it back. */
+	if (new_anchor.data.state == STATE_PARTIAL) {
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, desc, NULL) != NULL)
+			heap_put_partial (desc);
+	} else if (desc->remote_free) {
+		/* Our chain ran dry, so take back the remote frees. */
+		reclaim_remote_frees (desc);
+	}
+
+	if (desc->remote_free)
+		mono_hazard_pointer_clear (mono_hazard_pointer_get (), DESC_HAZARD);
+
+	return k;
+}
+
+/*
+ * Allocates up to n slots from a fresh superblock.  Returns zero if
+ * we lost the race to make it the active one, or -1 if there is no
+ * memory for a superblock.
+ */
+static int
+alloc_from_new_sb (MonoLockFreeAllocator *heap, gpointer *out, int n)
+{
+	unsigned int slot_size, count, i, k;
+	gpointer sb_header = alloc_sb (heap->sc->sb_size, heap->sc->node);
+	Descriptor *desc;
+
+	if (!sb_header)
+		return -1;
+
+	desc = desc_alloc ();
+	desc->stats_index = heap->sc->stats_index;
+	STAT_ADD (desc->stats_index, new_sbs, 1);
+	desc->sb_size = heap->sc->sb_size;
+	desc->numa_node = heap->sc->node;
+	desc->sb = register_sb (desc, sb_header, heap->sc->slot_alignment);
+
+	slot_size = desc->slot_size = heap->sc->slot_size;
+	count = SB_SLOTS_SIZE (desc->sb_size, heap->sc->slot_alignment) / slot_size;
+	k = MIN (n, count);
+
+	/*
+	 * Slots 0 to k - 1 are the ones we're allocating right away,
+	 * the rest form the untouched end of the chain.
+	 */
+	for (i = 0; i < k; ++i)
+		out [i] = (char*)desc->sb + i * slot_size;
+	desc->bump = k;
+
+	desc->heap = heap;
+	desc->cache_index = heap->sc->cache_index;
+	desc->remote_free = (heap->sc->flags & MONO_LOCK_FREE_ALLOC_REMOTE_FREE) != 0;
+	desc->remote_frees = NULL;
+	desc_acquire (desc);
+	desc->anchor.data.avail = k < count ? k : 0;
+	desc->slot_size = heap->sc->slot_size;
+	desc->max_count = count;
+	desc->trimmed = 0;
+
+	desc->anchor.data.count = desc->max_count - k;
+	desc->anchor.data.state = k < count ? STATE_PARTIAL : STATE_FULL;
+
+	mono_memory_write_barrier ();
+
+	/* A full descriptor isn't referenced by anybody. */
+	if (desc->anchor.data.state == STATE_FULL) {
+		STAT_ADD (desc->stats_index, allocs, k);
+		return k;
+	}
+
+	/* Make it active or free it again. */
+	if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, desc, NULL) == NULL) {
+		STAT_ADD (heap->sc->stats_index, allocs, k);
+		return k;
+	} else {
+		desc->anchor.data.state = STATE_EMPTY;
+		desc_retire (desc);
+		return 0;
+	}
+}
+
+gpointer
+mono_lock_free_alloc (MonoLockFreeAllocator *heap)
+{
+	gpointer addr;
+
+	for (;;) {
+		int k;
+
+		if (alloc_from_active_or_partial (heap, &addr, 1))
+			break;
+
+		k = alloc_from_new_sb (heap, &addr, 1);
+		if (k < 0)
+			return NULL;
+		if (k)
+			break;
+	}
+
+	return addr;
+}
+
+int
+mono_lock_free_alloc_bulk (MonoLockFreeAllocator *heap, int n, gpointer *out)
+{
+	int total = 0;
+
+	while (total < n) {
+		int k = alloc_from_active_or_partial (heap, out + total, n - total);
+		if (!k)
+			k = alloc_from_new_sb (heap, out + total, n - total);
+		if (k < 0)
+			break;
+		total += k;
+	}
+	return total;
+}
+
+/*
+ * Frees n slots of the same superblock, which the caller has already
+ * linked into a chain from first to last, with a single CAS.
+ *
+ * A free that empties an active descriptor races with the allocator
+ * that takes it from the heap, finds it EMPTY and retires it.  If the
+ * descriptor were reused and became active again before our CAS on
+ * the heap's active pointer, we'd retire it a second time, so we hold
+ * DESC_HAZARD on it from before the anchor CAS that empties it.
+ */
+static void
+free_chain (Descriptor *desc, gpointer first, gpointer last, int n)
+{
+	Anchor old_anchor, new_anchor;
+	gpointer sb;
+	MonoLockFreeAllocator *heap = NULL;
+	MonoThreadHazardPointers *hp = NULL;
+	gboolean protected = FALSE;
+
+	sb = desc->sb;
+	g_assert (SB_HEADER_FOR_ADDR (first, desc->sb_size) == SB_HEADER_FOR_ADDR (sb, desc->sb_size));
+	g_assert (SB_HEADER_FOR_ADDR (last, desc->sb_size) == SB_HEADER_FOR_ADDR (sb, desc->sb_size));
+
+	do {
+		new_anchor = old_anchor = *(volatile Anchor*)&desc->anchor.value;
+		*(unsigned int*)last = old_anchor.data.avail;
+		new_anchor.data.avail = ((char*)first - (char*)sb) / desc->slot_size;
+		g_assert (new_anchor.data.avail < desc->max_count);
+
+		if (old_anchor.data.state == STATE_FULL)
+			new_anchor.data.state = STATE_PARTIAL;
+
+		g_assert (old_anchor.data.count + n + desc->trimmed <= desc->max_count);
+		new_anchor.data.count += n;
+		if (new_anchor.data.count + desc->trimmed == desc->max_count) {
+			heap = desc->heap;
+			new_anchor.data.state = STATE_EMPTY;
+
+			/* Our caller might already be protecting it. */
+			if (!hp) {
+				hp = mono_hazard_pointer_get ();
+				if (mono_hazard_pointer_get_val (hp, DESC_HAZARD) != desc) {
+					mono_hazard_pointer_set (hp, DESC_HAZARD, desc);
+					protected = TRUE;
+				}
+			}
+		}
+	} while (!set_anchor (desc, old_anchor, new_anchor));
+
+	if (new_anchor.data.state == STATE_EMPTY) {
+		g_assert (old_anchor.data.state != STATE_EMPTY);
+
+		if (old_anchor.data.state == STATE_FULL) {
+			/*
+			 * A chain can take a descriptor from full to
+			 * empty in one go.  A full descriptor isn't
+			 * referenced by anybody, so it's ours.
+			 */
+			desc_retire (desc);
+		} else if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, NULL, desc) == desc) {
+			/* We own it, so we free it. */
+			desc_retire (desc);
+		} else {
+			/*
+			 * Somebody else must free it, so we do some
+			 * freeing for others.
+			 */
+			list_remove_empty_desc (heap->sc);
+		}
+	} else if (old_anchor.data.state == STATE_FULL) {
+		/*
+		 * Nobody owned it, now we do, so we need to give it
+		 * back.
+		 */
+
+		g_assert (new_anchor.data.state == STATE_PARTIAL);
+
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&desc->heap->active, desc, NULL) != NULL)
+			heap_put_partial (desc);
+	}
+
+	if (protected)
+		mono_hazard_pointer_clear (hp, DESC_HAZARD);
+}
+
+/*
+ * Pushes a chain of slots, linked through pointers, onto the remote
+ * free list.
+ */
+static void
+remote_free_chain (Descriptor *desc, gpointer first, gpointer last)
+{
+	MonoThreadHazardPointers *hp = mono_hazard_pointer_get ();
+	gpointer old_head;
+
+	mono_hazard_pointer_set (hp, DESC_HAZARD, desc);
+
+	do {
+		old_head = desc->remote_frees;
+		*(gpointer*)last = old_head;
+		mono_memory_write_barrier ();
+	} while (InterlockedCompareExchangePointer ((gpointer * volatile)&desc->remote_frees, first, old_head) != old_head);
+
+	if (desc->anchor.data.state == STATE_FULL)
+		reclaim_remote_frees (desc);
+
+	mono_hazard_pointer_clear (hp, DESC_HAZARD);
+}
+
+static void
+reclaim_remote_frees (Descriptor *desc)
+{
+	gpointer first, last, next;
+	int n;
+
+	if (!desc->remote_frees)
+		return;
+
+	first = InterlockedExchangePointer ((gpointer * volatile)&desc->remote_frees, NULL);
+	if (!first)
+		return;
+
+	/* Turn the pointer links into index links. */
+	n = 1;
+	for (last = first; (next = *(gpointer*)last); last = next) {
+		*(unsigned int*)last = ((char*)next - (char*)desc->sb) / desc->slot_size;
+		++n;
+	}
+
+	free_chain (desc, first, last, n);
+}
+
+static gboolean
+is_remote_free (Descriptor *desc)
+{
+	return desc->remote_free && !pthread_equal (desc->owner, pthread_self ());
+}
+
+static void
+free_slot (Descriptor *desc, gpointer ptr)
+{
+	STAT_ADD (desc->stats_index, frees, 1);
+
+	if (is_remote_free (desc))
+		remote_free_chain (desc, ptr, ptr);
+	else
+		free_chain (desc, ptr, ptr, 1);
+}
+
+static void thread_cache_free (Descriptor *desc, gpointer ptr);
+
+void
+mono_lock_free_free (gpointer ptr)
+{
+	Descriptor *desc = DESCRIPTOR_FOR_ADDR (ptr);
+
+	if (IS_LARGE_SPAN (desc))
+		free_large (desc, ptr);
+	else if (desc->cache_index >= 0)
+		thread_cache_free (desc, ptr);
+	else
+		free_slot (desc, ptr);
+}
+
+gboolean
+mono_lock_free_owns (gpointer ptr)
+{
+	return pagemap_get_safe (ptr) != NULL;
+}
+
+size_t
+mono_lock_free_usable_size (gpointer ptr)
+{
+	Descriptor *desc = DESCRIPTOR_FOR_ADDR (ptr);
+
+	if (IS_LARGE_SPAN (desc)) {
+		LargeSpan *span = LARGE_SPAN_FOR_DESC (desc);
+		return span->size - span->offset;
+	}
+	return desc->slot_size;
+}
+
+void
+mono_lock_free_free_bulk (gpointer *ptrs, int n)
+{
+	int i, j;
+
+	/* Sorting puts the slots of each superblock next to each other. */
+	mono_sort_pointers (ptrs, n);
+
+	for (i = 0; i < n; i = j) {
+		Descriptor *desc = DESCRIPTOR_FOR_ADDR (ptrs [i]);
+		int stats_index;
+
+		if (IS_LARGE_SPAN (desc)) {
+			free_large (desc, ptrs [i]);
+			j = i + 1;
+			continue;
+		}
+
+		/* The descriptor might be retired once we've freed. */
+		stats_index = desc->stats_index;
+
+		if (is_remote_free (desc)) {
+			for (j = i + 1; j < n && DESCRIPTOR_FOR_ADDR (ptrs [j]) == desc; ++j)
+				*(gpointer*)ptrs [j - 1] = ptrs [j];
+
+			remote_free_chain (desc, ptrs [i], ptrs [j - 1]);
+		} else {
+			for (j = i + 1; j < n && DESCRIPTOR_FOR_ADDR (ptrs [j]) == desc; ++j)
+				*(unsigned int*)ptrs [j - 1] = ((char*)ptrs [j] - (char*)desc->sb) / desc->slot_size;
+
+			free_chain (desc, ptrs [i], ptrs [j - 1], j - i);
+		}
+
+		STAT_ADD (stats_index, frees, j - i);
+	}
+}
+
+#define g_assert_OR_PRINT(c, format, ...)	do {				\
+		if (!(c)) {						\
+			if (print)					\
+				g_print ((format), ## __VA_ARGS__);	\
+			else						\
+				g_assert (FALSE);				\
+		}							\
+	} while (0)
+
+static void
+descriptor_check_consistency (Descriptor *desc, gboolean print)
+{
+	int count = desc->anchor.data.count;
+	int max_count = desc->max_count;
+#if _MSC_VER
+	gboolean* linked = alloca(max_count*sizeof(gboolean));
+#else
+	gboolean linked [max_count];
+#endif
+	int i, last;
+	unsigned int index;
+
+#ifndef DESC_AVAIL_DUMMY
+	g_assert_OR_PRINT (desc->in_use, "descriptor is not in use\n");
+#endif
+
+	g_assert_OR_PRINT (desc->slot_size == desc->heap->sc->slot_size, "slot size doesn't match size class\n");
+
+	if (print)
+		g_print ("descriptor %p is ", desc);
+
+	switch (desc->anchor.data.state) {
+	case STATE_FULL:
+		if (print)
+			g_print ("full\n");
+		g_assert_OR_PRINT (count == 0, "count is not zero: %d\n", count);
+		break;
+	case STATE_PARTIAL:
+		if (print)
+			g_print ("partial\n");
+		g_assert_OR_PRINT (count + desc->trimmed < max_count, "count too high: is %d but must be below %d\n", count, max_count - desc->trimmed);
+		break;
+	case STATE_EMPTY:
+		if (print)
+			g_print ("empty\n");
+		g_assert_OR_PRINT (count + desc->trimmed == max_count, "count is wrong: is %d but should be %d\n", count, max_count - desc->trimmed);
+		break;
+	default:
+		g_assert_OR_PRINT (FALSE, "invalid state\n");
+	}
+
+	for (i = 0; i < max_count; ++i)
+		linked [i] = FALSE;
+
+	index = desc->anchor.data.avail;
+	last = -1;
+	for (i = 0; i < count; ++i) {
+		g_assert_OR_PRINT (index >= 0 && index < max_count,
+				"index %d for %dth available slot, linked from %d, not in range [0 .. %d)\n",
+				index, i, last, max_count);
+		g_assert_OR_PRINT (!linked [index], "%dth available slot %d linked twice\n", i, index);
+		if (linked [index])
+			break;
+		linked [index] = TRUE;
+		last = index;
+		index = chain_next (desc, desc->bump, index);
+	}
+}
+
+gboolean
+mono_lock_free_allocator_check_consistency (MonoLockFreeAllocator *heap)
+{
+	Descriptor *active = heap->active;
+	Descriptor *desc;
+	if (active) {
+		g_assert (active->anchor.data.state == STATE_PARTIAL);
+		descriptor_check_consistency (active, FALSE);
+	}
+	while ((desc = partial_pop (heap->sc, TRUE))) {
+		g_assert (desc->anchor.data.state == STATE_PARTIAL || desc->anchor.data.state == STATE_EMPTY);
+		descriptor_check_consistency (desc, FALSE);
+	}
+	return TRUE;
+}
+
+static void register_size_class (MonoLockFreeAllocSizeClass *sc);
+
+void
+mono_lock_free_allocator_init_size_class_aligned (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size,
+		unsigned int alignment, guint32 flags)
+{
+	g_assert (!(alignment & (alignment - 1)) && alignment <= MONO_LOCK_FREE_ALLOC_MAX_ALIGNMENT);
+	if (alignment > 1)
+		slot_size = (slot_size + alignment - 1) & ~(alignment - 1);
+
+	g_assert (slot_size <= SB_SLOTS_SIZE (SB_MAX_SIZE, alignment) / 2);
+	if (flags & MONO_LOCK_FREE_ALLOC_REMOTE_FREE)
+		g_assert (slot_size >= sizeof (gpointer));
+
+	partial_queue_init (sc);
+	sc->slot_size = slot_size;
+	sc->slot_alignment = alignment;
+	sc->sb_size = choose_sb_size (slot_size, alignment, (flags & MONO_LOCK_FREE_ALLOC_HUGE_PAGES) != 0);
+	sc->flags = flags;
+	sc->cache_index = -1;
+	sc->partial_count = 0;
+	sc->node = -1;
+	sc->numa_next = sc;
+	register_size_class (sc);
+}
+
+void
+mono_lock_free_allocator_init_size_class_full (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size, guint32 flags)
+{
+	unsigned int alignment = 0;
+
+	if (flags & MONO_LOCK_FREE_ALLOC_NATURAL_ALIGNMENT)
+		alignment = MIN (slot_size & -slot_size, MONO_LOCK_FREE_ALLOC_MAX_NATURAL_ALIGNMENT);
+	mono_lock_free_allocator_init_size_class_aligned (sc, slot_size, alignment, flags);
+}
+
+void
+mono_lock_free_allocator_init_size_class (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size)
+{
+	mono_lock_free_allocator_init_size_class_full (sc, slot_size, 0);
+}
+
+void
+mono_lock_free_allocator_init_allocator (MonoLockFreeAllocator *heap, MonoLockFreeAllocSizeClass *sc)
+{
+	heap->sc = sc;
+	heap->active = NULL;
+}
+
+void
+mono_lock_free_allocator_set_size_class_node (MonoLockFreeAllocSizeClass *sc, int node)
+{
+	g_assert (node >= -1 && node < MONO_LOCK_FREE_NUMA_MAX_NODES);
+	sc->node = node;
+}
+
+void
+mono_lock_free_allocator_link_size_classes (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocSizeClass *other)
+{
+	g_assert (sc->slot_size == other->slot_size && other->numa_next == other);
+	other->numa_next = sc->numa_next;
+	sc->numa_next = other;
+}
+
+/*
+ * Trimming.  Memory normally goes back to the OS only when a superblock
+ * is retired and then falls out of the superblock cache, so a heap
+ * that spikes and settles keeps its partial superblocks resident.
+ * Trimming also releases the pages of partial superblocks that contain
+ * only free slots.
+ *
+ * To trim a descriptor we take it from the partial queue, so we own it,
+ * and allocate all of its free slots in one go.  The slots on pages we
+ * can release are kept allocated for good and counted in the
+ * descriptor's trimmed field, and the rest are freed again.  A
+ * descriptor with trimmed slots is empty when count + trimmed reaches
+ * max_count.  Then it is retired, and its superblock can be reused.
+ * We always keep one slot, because freeing it is what gives the
+ * descriptor back to the partial queue, or retires it.
+ *
+ * Only one thread trims at a time, because we use a single map of the
+ * free slots.
+ */
+static MonoLockFreeAllocSizeClass * volatile registered_size_classes;
+static volatile gint32 trim_running;
+static guint8 *trim_slot_map;
+
+#define TRIM_SLOT_MAP_SIZE	(SB_USABLE_SIZE (SB_HUGE_SIZE) / sizeof (unsigned int))
+
+enum {
+	SLOT_ALLOCATED,
+	SLOT_FREE,
+	SLOT_TRIMMED
+};
+
+static void
+register_size_class (MonoLockFreeAllocSizeClass *sc)
+{
+	MonoLockFreeAllocSizeClass *old_head;
+
+	sc->stats_index = InterlockedIncrement (&num_stats_classes) - 1;
+	if (sc->stats_index >= STATS_MAX_SIZE_CLASSES)
+		sc->stats_index = -1;
+
+	do {
+		old_head = registered_size_classes;
+		sc->next_registered = old_head;
+		mono_memory_write_barrier ();
+	} while (InterlockedCompareExchangePointer ((gpointer * volatile)&registered_size_classes, sc, old_head) != old_head);
+}
+
+/*
+ * Marks the slots on the pages we can release as trimmed and returns
+ * how many there are.
+ */
+static int
+mark_trimmable_slots (Descriptor *desc, unsigned int keep)
+{
+	size_t page_size = getpagesize ();
+	char *sb = desc->sb;
+	char *sb_end = (char*)SB_HEADER_FOR_ADDR (sb, desc->sb_size) + desc->sb_size;
+	char *page = (char*)(((gulong)sb + page_size - 1) & ~(gulong)(page_size - 1));
+	int num_trimmed = 0;
+
+	for (; page + page_size <= sb_end; page += page_size) {
+		unsigned int first = (page - sb) / desc->slot_size;
+		unsigned int last = MIN ((page + page_size - 1 - sb) / desc->slot_size, desc->max_count - 1);
+		unsigned int i;
+
+		if (first > last)
+			break;
+		if (keep >= first && keep <= last)
+			continue;
+
+		for (i = first; i <= last; ++i) {
+			if (trim_slot_map [i] == SLOT_ALLOCATED)
+				break;
+		}
+		if (i <= last)
+			continue;
+
+		for (i = first; i <= last; ++i) {
+			if (trim_slot_map [i] == SLOT_FREE) {
+				trim_slot_map [i] = SLOT_TRIMMED;
+				++num_trimmed;
+			}
+		}
+		madvise (page, page_size, MADV_DONTNEED);
+	}
+
+	return num_trimmed;
+}
+
+static void
+trim_descriptor (Descriptor *desc)
+{
+	Anchor old_anchor, new_anchor;
+	unsigned int first, next, i, bump;
+	gpointer first_kept = NULL, last_kept = NULL;
+	int count, num_kept = 0;
+
+	g_assert (desc->max_count <= TRIM_SLOT_MAP_SIZE);
+	desc_acquire (desc);
+	bump = desc->bump;
+
+	do {
+		new_anchor = old_anchor = *(volatile Anchor*)&desc->anchor.value;
+		if (old_anchor.data.state == STATE_EMPTY) {
+			desc_retire (desc);
+			return;
+		}
+		g_assert (old_anchor.data.state == STATE_PARTIAL);
+
+		mono_memory_read_barrier ();
+
+		/* Like in alloc_from_active_or_partial (), the chain is stable. */
+		memset (trim_slot_map, SLOT_ALLOCATED, desc->max_count);
+		count = old_anchor.data.count;
+		first = next = old_anchor.data.avail;
+		for (i = 0; i < count; ++i) {
+			g_assert (next < desc->max_count);
+			trim_slot_map [next] = SLOT_FREE;
+			next = chain_next (desc, bump, next);
+		}
+
+		new_anchor.data.count = 0;
+		new_anchor.data.state = STATE_FULL;
+
+		/*
+		 * The chain we build below links all the kept slots
+		 * explicitly.  See chain_next () for why this goes
+		 * before the CAS.
+		 */
+		desc->bump = desc->max_count;
+	} while (!set_anchor (desc, old_anchor, new_anchor));
+
+	desc->trimmed += mark_trimmable_slots (desc, first);
+	mono_memory_write_barrier ();
+
+	/* We made it full, so we have to take back the remote frees. */
+	if (desc->remote_free)
+		reclaim_remote_frees (desc);
+
+	for (i = 0; i < desc->max_count; ++i) {
+		gpointer slot = (char*)desc->sb + i * desc->slot_size;
+		if (trim_slot_map [i] != SLOT_FREE)
+			continue;
+		if (last_kept)
+			*(unsigned int*)last_kept = i;
+		else
+			first_kept = slot;
+		last_kept = slot;
+		++num_kept;
+	}
+	g_assert (num_kept > 0);
+
+	free_chain (desc, first_kept, last_kept, num_kept);
+}
+
+static void
+trim_size_class (MonoLockFreeAllocSizeClass *sc)
+{
+	int n = sc->partial_count;
+	Descriptor *desc;
+
+	while (n-- > 0 && (desc = list_get_partial (sc)))
+		trim_descriptor (desc);
+}
+
+static void
+release_cached_sbs (int percent)
+{
+	int node, i;
+
+	for (node = 0; node <= MONO_LOCK_FREE_NUMA_MAX_NODES; ++node) {
+		for (i = 0; i < SB_NUM_BINS; ++i) {
+			SBStack *cache = &sb_caches [node][i];
+			sb_cache_trim (cache, cache->count - (cache->count * percent + 99) / 100);
+		}
 	}
+	for (i = 0; i < LARGE_CACHE_NUM_BINS; ++i)
+		sb_cache_trim (&large_caches [i], large_caches [i].count - (large_caches [i].count * percent + 99) / 100);
 }
 
-gpointer
-mono_lock_free_alloc (MonoLockFreeAllocator *heap)
+/*
+ * Only one thread trims at a time.  The scavenger skips its pass if
+ * somebody else is trimming, but an explicit trim waits for the
+ * scavenger's pass to finish, because that might not release all it
+ * was asked to.
+ */
+static void
+trim (int cache_percent, gboolean wait)
 {
-	gpointer addr;
+	MonoLockFreeAllocSizeClass *sc;
 
-	for (;;) {
+	while (InterlockedCompareExchange (&trim_running, 1, 0) != 0) {
+		if (!wait)
+			return;
+		sched_yield ();
+	}
 
-		addr = alloc_from_active_or_partial (heap);
-		if (addr)
-			break;
+	if (!trim_slot_map)
+		trim_slot_map = mono_sgen_alloc_os_memory (TRIM_SLOT_MAP_SIZE, TRUE);
 
-		addr = alloc_from_new_sb (heap);
-		if (addr)
-			break;
+	for (sc = registered_size_classes; sc; sc = sc->next_registered)
+		trim_size_class (sc);
+	/* The descriptors we retired must be back before we trim their slabs. */
+	mono_thread_hazardous_free_all ();
+	release_cached_sbs (cache_percent);
+	trim_desc_slabs ();
+	/* Releases that a pop was looking at wait on our list. */
+	mono_thread_hazardous_free_all ();
+
+	mono_memory_write_barrier ();
+	trim_running = 0;
+}
+
+void
+mono_lock_free_allocator_trim (void)
+{
+	trim (100, TRUE);
+}
+
+/*
+ * The scavenger trims every interval.  It releases only a part of the
+ * cached superblocks each time, so that a cache that isn't used
+ * decays over a few intervals, but one that is still gets to do its
+ * job.
+ */
+static int scavenger_interval_ms;
+static int scavenger_decay_percent;
+
+static void*
+scavenger_thread_func (void *arg)
+{
+	mono_thread_attach ();
+
+	for (;;) {
+		usleep (scavenger_interval_ms * 1000);
+		trim (scavenger_decay_percent, FALSE);
 	}
 
-	return addr;
+	return NULL;
 }
 
 void
-mono_lock_free_free (gpointer ptr)
+mono_lock_free_allocator_start_scavenger (int interval_ms, int decay_percent)
 {
-	Anchor old_anchor, new_anchor;
-	Descriptor *desc;
-	gpointer sb;
-	MonoLockFreeAllocator *heap = NULL;
+	pthread_t thread;
 
-	desc = DESCRIPTOR_FOR_ADDR (ptr);
-	sb = desc->sb;
-	g_assert (SB_HEADER_FOR_ADDR (ptr) == SB_HEADER_FOR_ADDR (sb));
+	g_assert (interval_ms > 0 && decay_percent >= 0 && decay_percent <= 100);
+	g_assert (!scavenger_interval_ms);
 
-	do {
-		new_anchor = old_anchor = *(volatile Anchor*)&desc->anchor.value;
-		*(unsigned int*)ptr = old_anchor.data.avail;
-		new_anchor.data.avail = ((char*)ptr - (char*)sb) / desc->slot_size;
-		g_assert (new_anchor.data.avail < SB_USABLE_SIZE / desc->slot_size);
+	scavenger_interval_ms = interval_ms;
+	scavenger_decay_percent = decay_percent;
+	pthread_create (&thread, NULL, scavenger_thread_func, NULL);
+	pthread_detach (thread);
+}
 
-		if (old_anchor.data.state == STATE_FULL)
-			new_anchor.data.state = STATE_PARTIAL;
+/*
+ * The malloc front-end: a fixed table of size classes, each with its
+ * own allocator.  Up to 1024 bytes the classes are spaced so that
+ * rounding up wastes at most a quarter of the slot.  Above that each
+ * class is the biggest slot size that still fits a given number of
+ * slots into a minimum sized superblock.
+ *
+ * All classes except the smallest one are multiples of 16, which,
+ * together with the 16 byte superblock header, gives slots the same
+ * alignment guarantee as the system malloc.  The classes are also
+ * naturally aligned, so the slots of the 64, 128, 256 etc. byte
+ * classes are cache line aligned, which lets
+ * mono_lock_free_malloc_aligned () use them.  That costs no slots,
+ * because the padding is smaller than a slot.
+ */
 
-		if (++new_anchor.data.count == desc->max_count) {
-			heap = desc->heap;
-			new_anchor.data.state = STATE_EMPTY;
-		}
-	} while (!set_anchor (desc, old_anchor, new_anchor));
+#define MALLOC_ALIGNMENT	16
+#define MALLOC_GRANULE		8
 
-	if (new_anchor.data.state == STATE_EMPTY) {
-		g_assert (old_anchor.data.state != STATE_EMPTY);
+#define SLOTS_PER_SB(n)		((SB_USABLE_SIZE (SB_MIN_SIZE) / (n)) & ~(MALLOC_ALIGNMENT - 1))
 
-		if (InterlockedCompareExchangePointer ((gpointer * volatile)&heap->active, NULL, desc) == desc) {
-			/* We own it, so we free it. */
-			desc_retire (desc);
-		} else {
-			/*
-			 * Somebody else must free it, so we do some
-			 * freeing for others.
-			 */
-			list_remove_empty_desc (heap->sc);
-		}
-	} else if (old_anchor.data.state == STATE_FULL) {
-		/*
-		 * Nobody owned it, now we do, so we need to give it
-		 * back.
-		 */
+#define MALLOC_MAX_SIZE		SLOTS_PER_SB (2)
 
-		g_assert (new_anchor.data.state == STATE_PARTIAL);
+static const unsigned int malloc_class_sizes [] = {
+	8, 16, 32, 48, 64, 80, 96, 112,
+	128, 160, 192, 224, 256, 320, 384, 448,
+	512, 640, 768, 896, 1024,
+	SLOTS_PER_SB (12), SLOTS_PER_SB (10), SLOTS_PER_SB (8), SLOTS_PER_SB (7),
+	SLOTS_PER_SB (6), SLOTS_PER_SB (5), SLOTS_PER_SB (4), SLOTS_PER_SB (3),
+	MALLOC_MAX_SIZE
+};
 
-		if (InterlockedCompareExchangePointer ((gpointer * volatile)&desc->heap->active, desc, NULL) != NULL)
-			heap_put_partial (desc);
+#define MALLOC_NUM_CLASSES	(sizeof (malloc_class_sizes) / sizeof (malloc_class_sizes [0]))
+
+/* Address space reserved with MONO_LOCK_FREE_MALLOC_ARENA. */
+#if defined(__x86_64__) || defined(__LP64__)
+#define MALLOC_ARENA_SIZE	((size_t)16 * 1024 * 1024 * 1024)
+#else
+#define MALLOC_ARENA_SIZE	((size_t)256 * 1024 * 1024)
+#endif
+
+/* One set of size classes per NUMA node, or just one without NUMA. */
+static MonoLockFreeAllocSizeClass malloc_size_classes [MONO_LOCK_FREE_NUMA_MAX_NODES][MALLOC_NUM_CLASSES];
+static int malloc_num_nodes;
+
+/*
+ * One set of allocators, i.e. one per size class, per heap set.
+ * Without per-CPU heaps there is only one set per node, otherwise
+ * there is one for each CPU, all sets on a node sharing the node's
+ * size classes and therefore the partial queues.
+ */
+static MonoLockFreeAllocator *malloc_heaps;
+static int malloc_num_heap_sets;
+static gboolean malloc_per_cpu_heaps;
+
+/*
+ * Per-thread caches.  Each thread has a magazine of free slots for
+ * every size class, from which it allocates and to which it frees
+ * without any atomic operations.  An empty magazine is refilled, and
+ * a full one half flushed, through the ordinary allocator.
+ *
+ * When a thread exits its cache is put on the orphaned list instead of
+ * being flushed right away, because the thread's hazard pointers might
+ * already be gone at that point.  Orphaned caches are flushed by the
+ * next thread that has to refill a magazine.
+ */
+
+#define MAGAZINE_SIZE	32
+
+typedef struct {
+	int count;
+	gpointer slots [MAGAZINE_SIZE];
+} Magazine;
+
+typedef struct _ThreadCache ThreadCache;
+struct _ThreadCache {
+	ThreadCache *next;
+	Magazine magazines [MALLOC_NUM_CLASSES];
+};
+
+static gboolean malloc_thread_caches;
+static pthread_key_t thread_cache_key;
+static ThreadCache * volatile orphaned_thread_caches;
+
+static void
+magazine_flush (Magazine *mag, int n)
+{
+	gpointer slots [MAGAZINE_SIZE];
+
+	g_assert (n <= mag->count);
+
+	/*
+	 * Take the slots out before freeing them, so that the magazine
+	 * is consistent should freeing get back into the front-end.
+	 */
+	memcpy (slots, mag->slots, n * sizeof (gpointer));
+
+	/* Keep the most recently freed, i.e. hottest, slots. */
+	mag->count -= n;
+	memmove (mag->slots, mag->slots + n, mag->count * sizeof (gpointer));
+
+	mono_lock_free_free_bulk (slots, n);
+}
+
+static void
+thread_cache_flush (ThreadCache *cache)
+{
+	int i;
+
+	for (i = 0; i < MALLOC_NUM_CLASSES; ++i)
+		magazine_flush (&cache->magazines [i], cache->magazines [i].count);
+}
+
+static void
+thread_cache_orphan (gpointer _cache)
+{
+	ThreadCache *cache = _cache;
+	ThreadCache *old_head;
+
+	do {
+		old_head = orphaned_thread_caches;
+		cache->next = old_head;
+		mono_memory_write_barrier ();
+	} while (InterlockedCompareExchangePointer ((gpointer * volatile)&orphaned_thread_caches, cache, old_head) != old_head);
+}
+
+static void
+flush_orphaned_thread_caches (void)
+{
+	ThreadCache *cache;
+
+	if (!orphaned_thread_caches)
+		return;
+
+	/* Taking the whole list at once means we own all of it. */
+	cache = InterlockedExchangePointer ((gpointer * volatile)&orphaned_thread_caches, NULL);
+	while (cache) {
+		ThreadCache *next = cache->next;
+		thread_cache_flush (cache);
+		mono_sgen_free_os_memory (cache, sizeof (ThreadCache));
+		cache = next;
 	}
 }
 
-#define g_assert_OR_PRINT(c, format, ...)	do {				\
-		if (!(c)) {						\
-			if (print)					\
-				g_print ((format), ## __VA_ARGS__);	\
-			else						\
-				g_assert (FALSE);				\
-		}							\
-	} while (0)
+static ThreadCache*
+thread_cache_get (void)
+{
+	ThreadCache *cache = pthread_getspecific (thread_cache_key);
+	if (!cache) {
+		cache = mono_sgen_alloc_os_memory (sizeof (ThreadCache), TRUE);
+		if (cache)
+			pthread_setspecific (thread_cache_key, cache);
+	}
+	return cache;
+}
 
 static void
-descriptor_check_consistency (Descriptor *desc, gboolean print)
+magazine_refill (Magazine *mag, MonoLockFreeAllocator *heap)
 {
-	int count = desc->anchor.data.count;
-	int max_count = SB_USABLE_SIZE / desc->slot_size;
-#if _MSC_VER
-	gboolean* linked = alloca(max_count*sizeof(gboolean));
-#else
-	gboolean linked [max_count];
-#endif
-	int i, last;
-	unsigned int index;
+	g_assert (mag->count == 0);
 
-#ifndef DESC_AVAIL_DUMMY
-	Descriptor *avail;
+	flush_orphaned_thread_caches ();
+
+	mag->count = mono_lock_free_alloc_bulk (heap, MAGAZINE_SIZE / 2, mag->slots);
+}
+
+static void
+thread_cache_free (Descriptor *desc, gpointer ptr)
+{
+	ThreadCache *cache = thread_cache_get ();
+	Magazine *mag;
+
+	if (!cache) {
+		free_slot (desc, ptr);
+		return;
+	}
+
+	mag = &cache->magazines [desc->cache_index];
+	if (mag->count == MAGAZINE_SIZE)
+		magazine_flush (mag, MAGAZINE_SIZE / 2);
+	mag->slots [mag->count++] = ptr;
+}
+
+/*
+ * Maps a size, in units of MALLOC_GRANULE, rounded up, to the index of
+ * the smallest class that fits it.  This keeps the lookup down to a
+ * single load, with no search over the classes.
+ */
+static guint8 malloc_size_to_class [MALLOC_MAX_SIZE / MALLOC_GRANULE + 1];
+
+void
+mono_lock_free_malloc_init (guint32 flags)
+{
+	int i, index;
+
+	guint32 sc_flags = MONO_LOCK_FREE_ALLOC_NATURAL_ALIGNMENT;
+
+	if (flags & MONO_LOCK_FREE_MALLOC_REMOTE_FREE)
+		sc_flags |= MONO_LOCK_FREE_ALLOC_REMOTE_FREE;
+	if (flags & MONO_LOCK_FREE_MALLOC_HUGE_PAGES)
+		sc_flags |= MONO_LOCK_FREE_ALLOC_HUGE_PAGES;
+
+	if (flags & MONO_LOCK_FREE_MALLOC_ARENA)
+		mono_lock_free_allocator_init_arena (MALLOC_ARENA_SIZE);
+
+	malloc_thread_caches = (flags & MONO_LOCK_FREE_MALLOC_THREAD_CACHES) != 0;
+	if (malloc_thread_caches)
+		pthread_key_create (&thread_cache_key, thread_cache_orphan);
+
+	malloc_num_nodes = 1;
+	if (flags & MONO_LOCK_FREE_MALLOC_NUMA)
+		malloc_num_nodes = mono_lock_free_numa_num_nodes ();
 
-	for (avail = desc_avail; avail; avail = avail->next)
-		g_assert_OR_PRINT (desc != avail, "descriptor is in the available list\n");
+	malloc_num_heap_sets = malloc_num_nodes;
+#ifdef __linux__
+	if (flags & MONO_LOCK_FREE_MALLOC_PER_CPU_HEAPS) {
+		long num_cpus = sysconf (_SC_NPROCESSORS_CONF);
+		if (num_cpus > 1) {
+			malloc_num_heap_sets = num_cpus;
+			malloc_per_cpu_heaps = TRUE;
+		}
+	}
 #endif
 
-	g_assert_OR_PRINT (desc->slot_size == desc->heap->sc->slot_size, "slot size doesn't match size class\n");
+	malloc_heaps = mono_sgen_alloc_os_memory (sizeof (MonoLockFreeAllocator) * MALLOC_NUM_CLASSES * malloc_num_heap_sets, TRUE);
 
-	if (print)
-		g_print ("descriptor %p is ", desc);
+	for (i = 0; i < MALLOC_NUM_CLASSES; ++i) {
+		int j, node;
 
-	switch (desc->anchor.data.state) {
-	case STATE_FULL:
-		if (print)
-			g_print ("full\n");
-		g_assert_OR_PRINT (count == 0, "count is not zero: %d\n", count);
-		break;
-	case STATE_PARTIAL:
-		if (print)
-			g_print ("partial\n");
-		g_assert_OR_PRINT (count < max_count, "count too high: is %d but must be below %d\n", count, max_count);
-		break;
-	case STATE_EMPTY:
-		if (print)
-			g_print ("empty\n");
-		g_assert_OR_PRINT (count == max_count, "count is wrong: is %d but should be %d\n", count, max_count);
-		break;
-	default:
-		g_assert_OR_PRINT (FALSE, "invalid state\n");
+		g_assert (i == 0 || malloc_class_sizes [i] > malloc_class_sizes [i - 1]);
+		for (node = 0; node < malloc_num_nodes; ++node) {
+			MonoLockFreeAllocSizeClass *sc = &malloc_size_classes [node][i];
+
+			mono_lock_free_allocator_init_size_class_full (sc, malloc_class_sizes [i], sc_flags);
+			if (malloc_thread_caches)
+				sc->cache_index = i;
+			if (malloc_num_nodes > 1) {
+				mono_lock_free_allocator_set_size_class_node (sc, node);
+				if (node > 0)
+					mono_lock_free_allocator_link_size_classes (&malloc_size_classes [0][i], sc);
+			}
+		}
+		for (j = 0; j < malloc_num_heap_sets; ++j) {
+			node = malloc_per_cpu_heaps ? mono_lock_free_numa_node_of_cpu (j) : j;
+			if (node >= malloc_num_nodes)
+				node = 0;
+			mono_lock_free_allocator_init_allocator (&malloc_heaps [j * MALLOC_NUM_CLASSES + i], &malloc_size_classes [node][i]);
+		}
 	}
 
-	for (i = 0; i < max_count; ++i)
-		linked [i] = FALSE;
+	index = 0;
+	for (i = 0; i <= MALLOC_MAX_SIZE / MALLOC_GRANULE; ++i) {
+		while (malloc_class_sizes [index] < i * MALLOC_GRANULE)
+			++index;
+		malloc_size_to_class [i] = index;
+	}
+}
 
-	index = desc->anchor.data.avail;
-	last = -1;
-	for (i = 0; i < count; ++i) {
-		gpointer addr = (char*)desc->sb + index * desc->slot_size;
-		g_assert_OR_PRINT (index >= 0 && index < max_count,
-				"index %d for %dth available slot, linked from %d, not in range [0 .. %d)\n",
-				index, i, last, max_count);
-		g_assert_OR_PRINT (!linked [index], "%dth available slot %d linked twice\n", i, index);
-		if (linked [index])
-			break;
-		linked [index] = TRUE;
-		last = index;
-		index = *(unsigned int*)addr;
+/*
+ * The heaps of the CPU or node we're running on.  We might be migrated right
+ * after asking, but that only costs contention, not correctness.
+ */
+static MonoLockFreeAllocator*
+current_heap_set (void)
+{
+#ifdef __linux__
+	if (malloc_per_cpu_heaps) {
+		int cpu = sched_getcpu ();
+		if (cpu >= 0)
+			return &malloc_heaps [(cpu % malloc_num_heap_sets) * MALLOC_NUM_CLASSES];
 	}
+#endif
+	if (malloc_num_nodes > 1)
+		return &malloc_heaps [mono_lock_free_numa_current_node () * MALLOC_NUM_CLASSES];
+	return malloc_heaps;
 }
 
-gboolean
-mono_lock_free_allocator_check_consistency (MonoLockFreeAllocator *heap)
+static gpointer
+malloc_from_class (int index)
+{
+	ThreadCache *cache = malloc_thread_caches ? thread_cache_get () : NULL;
+
+	/* Without memory for a cache we do without it. */
+	if (cache) {
+		Magazine *mag = &cache->magazines [index];
+		if (!mag->count) {
+			magazine_refill (mag, &current_heap_set () [index]);
+			if (!mag->count)
+				return NULL;
+		}
+		return mag->slots [--mag->count];
+	}
+
+	return mono_lock_free_alloc (&current_heap_set () [index]);
+}
+
+gpointer
+mono_lock_free_malloc (size_t size)
+{
+	if (size > MALLOC_MAX_SIZE)
+		return mono_lock_free_alloc_large (size);
+
+	return malloc_from_class (malloc_size_to_class [(size + MALLOC_GRANULE - 1) / MALLOC_GRANULE]);
+}
+
+gpointer
+mono_lock_free_malloc_aligned (size_t size, size_t alignment)
+{
+	int index;
+
+	g_assert (!(alignment & (alignment - 1)));
+
+	if (alignment <= 8 || (alignment <= MALLOC_ALIGNMENT && size > 8))
+		return mono_lock_free_malloc (size);
+	if (alignment > MONO_LOCK_FREE_ALLOC_MAX_NATURAL_ALIGNMENT || size > MALLOC_MAX_SIZE)
+		return mono_lock_free_alloc_large_aligned (size, alignment);
+
+	/* A class whose size is a multiple of the alignment is aligned to it. */
+	index = malloc_size_to_class [(MAX (size, alignment) + MALLOC_GRANULE - 1) / MALLOC_GRANULE];
+	while (index < MALLOC_NUM_CLASSES && malloc_class_sizes [index] % alignment)
+		++index;
+	if (index == MALLOC_NUM_CLASSES)
+		return mono_lock_free_alloc_large_aligned (size, alignment);
+
+	return malloc_from_class (index);
+}
+
+/*
+ * Slots are only ever handed out whole, so growing within the slot is free.
+ * Large spans are also kept when they shrink, unless they'd end up less
+ * than half used.
+ */
+gpointer
+mono_lock_free_realloc (gpointer ptr, size_t size)
 {
-	Descriptor *active = heap->active;
 	Descriptor *desc;
-	if (active) {
-		g_assert (active->anchor.data.state == STATE_PARTIAL);
-		descriptor_check_consistency (active, FALSE);
+	gpointer new_ptr;
+	size_t old_size;
+
+	if (!ptr)
+		return mono_lock_free_malloc (size);
+	if (!size) {
+		mono_lock_free_free (ptr);
+		return NULL;
 	}
-	while ((desc = (Descriptor*)mono_lock_free_queue_dequeue (&heap->sc->partial))) {
-		g_assert (desc->anchor.data.state == STATE_PARTIAL || desc->anchor.data.state == STATE_EMPTY);
-		descriptor_check_consistency (desc, FALSE);
+
+	desc = DESCRIPTOR_FOR_ADDR (ptr);
+	if (IS_LARGE_SPAN (desc)) {
+		old_size = mono_lock_free_usable_size (ptr);
+		if (size <= old_size && size > old_size / 2)
+			return ptr;
+	} else {
+		old_size = desc->slot_size;
+		if (size <= old_size)
+			return ptr;
 	}
-	return TRUE;
+
+	new_ptr = mono_lock_free_malloc (size);
+	if (!new_ptr)
+		return NULL;
+	memcpy (new_ptr, ptr, MIN (old_size, size));
+	mono_lock_free_free (ptr);
+	return new_ptr;
 }
 
 void
-mono_lock_free_allocator_init_size_class (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size)
+mono_lock_free_malloc_flush_thread_cache (void)
 {
-	g_assert (slot_size <= SB_USABLE_SIZE / 2);
+	ThreadCache *cache;
 
-	mono_lock_free_queue_init (&sc->partial);
-	sc->slot_size = slot_size;
+	if (!malloc_thread_caches)
+		return;
+
+	cache = pthread_getspecific (thread_cache_key);
+	if (cache)
+		thread_cache_flush (cache);
+	flush_orphaned_thread_caches ();
 }
 
-void
-mono_lock_free_allocator_init_allocator (MonoLockFreeAllocator *heap, MonoLockFreeAllocSizeClass *sc)
+gboolean
+mono_lock_free_malloc_check_consistency (void)
 {
-	heap->sc = sc;
-	heap->active = NULL;
+	int i;
+
+	mono_lock_free_malloc_flush_thread_cache ();
+
+	for (i = 0; i < MALLOC_NUM_CLASSES * malloc_num_heap_sets; ++i) {
+		if (!mono_lock_free_allocator_check_consistency (&malloc_heaps [i]))
+			return FALSE;
+	}
+	return TRUE;
 }
@@ -30,12 +30,78 @@
 
 #include "lock-free-queue.h"
 
+enum {
+	/*
+	 * Frees by threads other than the one allocating from a
+	 * superblock go onto a separate list, which the allocating
+	 * thread reclaims in one go.
+	 */
+	MONO_LOCK_FREE_ALLOC_REMOTE_FREE = 1 << 0,
+	/*
+	 * Use 2 MB superblocks backed by huge pages, falling back to
+	 * transparent huge pages if none are reserved.
+	 */
+	MONO_LOCK_FREE_ALLOC_HUGE_PAGES = 1 << 1,
+	/*
+	 * Align each slot to the largest power of two dividing the slot
+	 * size, up to MONO_LOCK_FREE_ALLOC_MAX_NATURAL_ALIGNMENT, so that
+	 * cache line sized objects don't straddle cache lines.
+	 */
+	MONO_LOCK_FREE_ALLOC_NATURAL_ALIGNMENT = 1 << 2,
+	/*
+	 * Keep partial superblocks on a stack instead of in a FIFO
+	 * queue, so that the most recently used one, whose slots are
+	 * likely still cached, is the next one we allocate from.
+	 */
+	MONO_LOCK_FREE_ALLOC_PARTIAL_LIFO = 1 << 3,
+	/*
+	 * Bin partial superblocks by occupancy and allocate from the
+	 * fullest ones first.  Live objects get concentrated in few
+	 * superblocks, and the rest drain and are retired.
+	 */
+	MONO_LOCK_FREE_ALLOC_PARTIAL_FULLEST_FIRST = 1 << 4
+};
+
+#define MONO_LOCK_FREE_ALLOC_MAX_NATURAL_ALIGNMENT	128
+/* The most mono_lock_free_allocator_init_size_class_aligned () can do. */
+#define MONO_LOCK_FREE_ALLOC_MAX_ALIGNMENT	4096
+
+#define MONO_LOCK_FREE_ALLOC_PARTIAL_BINS	4
+
+struct _MonoLockFreeAllocDescriptor;
+
+#ifdef __x86_64__
+/* A stack of partial nodes with a counted top, see lock-free-alloc.c. */
 typedef struct {
+	gpointer volatile top;
+	volatile gint64 count;
+} __attribute__ ((aligned (16))) MonoLockFreeAllocNodeStack;
+#endif
+
+typedef struct _MonoLockFreeAllocSizeClass MonoLockFreeAllocSizeClass;
+struct _MonoLockFreeAllocSizeClass {
+#ifdef __x86_64__
+	/* Tagged pointers to partial nodes, see lock-free-alloc.c. */
+	volatile gint64 partial_head;
+	volatile gint64 partial_tail;
+	MonoLockFreeAllocNodeStack partial_bins [MONO_LOCK_FREE_ALLOC_PARTIAL_BINS];
+	MonoLockFreeAllocNodeStack partial_node_free;	/* recycled nodes */
+#else
 	MonoLockFreeQueue partial;
+	/* Used instead of the queue by the LIFO and fullest first policies. */
+	struct _MonoLockFreeAllocDescriptor * volatile partial_bins [MONO_LOCK_FREE_ALLOC_PARTIAL_BINS];
+#endif
+	volatile gint32 partial_count;	/* approximate */
 	unsigned int slot_size;
-} MonoLockFreeAllocSizeClass;
-
-struct _MonoLockFreeAllocDescriptor;
+	unsigned int sb_size;	/* chosen by init to bound waste */
+	unsigned int slot_alignment;
+	guint32 flags;
+	int cache_index;	/* per-thread magazine index, or -1 */
+	int node;		/* NUMA node, or -1 */
+	MonoLockFreeAllocSizeClass *numa_next;
+	MonoLockFreeAllocSizeClass *next_registered;
+	int stats_index;	/* or -1 if there are too many size classes */
+};
 
 typedef struct {
 	struct _MonoLockFreeAllocDescriptor *active;
@@ -43,11 +109,159 @@ typedef struct {
 } MonoLockFreeAllocator;
 
 void mono_lock_free_allocator_init_size_class (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size) MONO_INTERNAL;
+void mono_lock_free_allocator_init_size_class_full (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size, guint32 flags) MONO_INTERNAL;
+/*
+ * Aligns the slots to alignment, a power of two, by starting the slot
+ * array that far into the superblock and rounding the slot size up.
+ */
+void mono_lock_free_allocator_init_size_class_aligned (MonoLockFreeAllocSizeClass *sc, unsigned int slot_size,
+		unsigned int alignment, guint32 flags) MONO_INTERNAL;
 void mono_lock_free_allocator_init_allocator (MonoLockFreeAllocator *heap, MonoLockFreeAllocSizeClass *sc) MONO_INTERNAL;
 
+/*
+ * A size class tied to a NUMA node gets its superblocks from that
+ * node's memory.  Size classes for the same slot size on different
+ * nodes are linked into a ring.  An allocator that runs out of
+ * partial superblocks steals them through the ring from nodes that
+ * have plenty, before it maps a new superblock.
+ */
+void mono_lock_free_allocator_set_size_class_node (MonoLockFreeAllocSizeClass *sc, int node) MONO_INTERNAL;
+void mono_lock_free_allocator_link_size_classes (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocSizeClass *other) MONO_INTERNAL;
+
+#define MONO_LOCK_FREE_NUMA_MAX_NODES	8
+
+int mono_lock_free_numa_num_nodes (void) MONO_INTERNAL;
+int mono_lock_free_numa_node_of_cpu (int cpu) MONO_INTERNAL;
+int mono_lock_free_numa_current_node (void) MONO_INTERNAL;
+
+/*
+ * Pretends the machine has num_nodes nodes, with CPUs assigned to them
+ * round robin, so that NUMA code can be tested on any machine.
+ * Memory is not bound to simulated nodes.  Must be called before any
+ * of the above.
+ */
+void mono_lock_free_numa_simulate (int num_nodes) MONO_INTERNAL;
+
+/* Returns NULL if there is no memory for a new superblock. */
 gpointer mono_lock_free_alloc (MonoLockFreeAllocator *heap) MONO_INTERNAL;
 void mono_lock_free_free (gpointer ptr) MONO_INTERNAL;
 
+/*
+ * Allocates an object of any size in a mapping of its own, aligned
+ * to 16 bytes.  Meant for sizes too big for size classes.  Returns
+ * NULL if the memory can't be had.  Freed with mono_lock_free_free ().
+ */
+gpointer mono_lock_free_alloc_large (size_t size) MONO_INTERNAL;
+/* Like the above, with the object aligned to a power of two. */
+gpointer mono_lock_free_alloc_large_aligned (size_t size, size_t alignment) MONO_INTERNAL;
+
+/* Whether ptr was allocated by us, for any ptr. */
+gboolean mono_lock_free_owns (gpointer ptr) MONO_INTERNAL;
+/* The number of bytes that can be used at ptr. */
+size_t mono_lock_free_usable_size (gpointer ptr) MONO_INTERNAL;
+
+/*
+ * Allocate or free many slots at once, with one CAS per superblock
+ * instead of one per slot.  mono_lock_free_alloc_bulk () returns the
+ * number of slots allocated, which is less than n only if we ran out
+ * of memory.  mono_lock_free_free_bulk () sorts ptrs.
+ */
+int mono_lock_free_alloc_bulk (MonoLockFreeAllocator *heap, int n, gpointer *out) MONO_INTERNAL;
+void mono_lock_free_free_bulk (gpointer *ptrs, int n) MONO_INTERNAL;
+
 gboolean mono_lock_free_allocator_check_consistency (MonoLockFreeAllocator *heap) MONO_INTERNAL;
 
+/*
+ * Retired superblocks are cached for reuse.  Once more than high_bytes
+ * worth of superblocks of one size are cached, superblocks of that
+ * size are returned to the OS until only low_bytes worth are left.
+ */
+void mono_lock_free_allocator_set_sb_cache_watermarks (size_t low_bytes, size_t high_bytes) MONO_INTERNAL;
+
+/*
+ * Reserves size bytes of address space from which all superblocks are
+ * carved from then on.  Once it's used up we fall back to mapping
+ * superblocks individually.  Must be called before the first
+ * allocation.
+ */
+void mono_lock_free_allocator_init_arena (size_t size) MONO_INTERNAL;
+
+/*
+ * Returns free memory to the OS: pages of partial superblocks that
+ * hold only free slots, and all cached superblocks and large spans.
+ * If the scavenger is trimming, waits for it to finish first.
+ */
+void mono_lock_free_allocator_trim (void) MONO_INTERNAL;
+
+/*
+ * Starts a thread that trims every interval_ms milliseconds, but only
+ * releases decay_percent of the cached superblocks each time.
+ */
+void mono_lock_free_allocator_start_scavenger (int interval_ms, int decay_percent) MONO_INTERNAL;
+
+/*
+ * Statistics, counted per thread and summed up by
+ * mono_lock_free_allocator_get_stats ().  Slots sitting in per-thread
+ * magazines count as allocated.
+ */
+typedef struct {
+	gulong allocs;
+	gulong frees;
+	gulong anchor_cas_retries;
+	gulong new_superblocks;		/* alloc_from_new_sb () calls */
+	gulong retired_superblocks;	/* desc_retire () calls */
+	long live_superblocks;
+	long live_bytes;
+	int partial_queue_length;	/* approximate */
+} MonoLockFreeAllocStats;
+
+void mono_lock_free_allocator_get_stats (MonoLockFreeAllocSizeClass *sc, MonoLockFreeAllocStats *stats) MONO_INTERNAL;
+
+/*
+ * A malloc-like front-end with a built-in table of size classes.
+ * Memory it returns is freed with mono_lock_free_free ().  Sizes
+ * above the biggest size class are served by
+ * mono_lock_free_alloc_large ().
+ */
+enum {
+	/* Serve allocs and frees from per-thread magazines. */
+	MONO_LOCK_FREE_MALLOC_THREAD_CACHES = 1 << 0,
+	/* One allocator per size class and CPU, picked by sched_getcpu (). */
+	MONO_LOCK_FREE_MALLOC_PER_CPU_HEAPS = 1 << 1,
+	/* Size classes use MONO_LOCK_FREE_ALLOC_REMOTE_FREE. */
+	MONO_LOCK_FREE_MALLOC_REMOTE_FREE = 1 << 2,
+	/* Size classes use MONO_LOCK_FREE_ALLOC_HUGE_PAGES. */
+	MONO_LOCK_FREE_MALLOC_HUGE_PAGES = 1 << 3,
+	/* Superblocks come from a reserved arena. */
+	MONO_LOCK_FREE_MALLOC_ARENA = 1 << 4,
+	/*
+	 * Size classes and heaps per NUMA node, with superblocks from
+	 * the node's memory.  With per-CPU heaps each CPU's heaps use
+	 * its node's size classes.
+	 */
+	MONO_LOCK_FREE_MALLOC_NUMA = 1 << 5
+};
+
+void mono_lock_free_malloc_init (guint32 flags) MONO_INTERNAL;
+gpointer mono_lock_free_malloc (size_t size) MONO_INTERNAL;
+/*
+ * Like mono_lock_free_malloc (), with the memory aligned to a power of
+ * two.  Alignments up to MONO_LOCK_FREE_ALLOC_MAX_NATURAL_ALIGNMENT
+ * come from the size classes whose slots are aligned to it.
+ */
+gpointer mono_lock_free_malloc_aligned (size_t size, size_t alignment) MONO_INTERNAL;
+
+/*
+ * Returns PTR itself if SIZE still fits in its slot, otherwise moves the
+ * contents to a new block and frees PTR.  Like realloc (), a NULL PTR
+ * allocates and a zero SIZE frees.  PTR must be from
+ * mono_lock_free_malloc () or mono_lock_free_alloc_large ().
+ */
+gpointer mono_lock_free_realloc (gpointer ptr, size_t size) MONO_INTERNAL;
+
+/* Returns the calling thread's cached slots to the allocator. */
+void mono_lock_free_malloc_flush_thread_cache (void) MONO_INTERNAL;
+
+gboolean mono_lock_free_malloc_check_consistency (void) MONO_INTERNAL;
+
 #endif
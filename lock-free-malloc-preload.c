@@ -0,0 +1,261 @@
+/*
+ * lock-free-malloc-preload.c: A malloc replacement on top of the
+ * lock-free allocator, to be loaded with LD_PRELOAD.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Small sizes go through the size classes of the malloc front-end,
+ * big ones get mappings of their own.
+ *
+ * Initializing the allocator can call malloc () itself, for example
+ * sysconf () does to count the CPUs.  The initializing thread gets
+ * such memory from a static bootstrap buffer, which is never freed.
+ * Each bootstrap block is preceded by its size, so that realloc () can
+ * move it into the allocator.  Other threads wait for the
+ * initialization to finish.
+ *
+ * Threads are attached for hazard pointers on their first call.
+ *
+ * Pointers we didn't allocate, like those from the bootstrap buffer,
+ * are ignored by free ().
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "fake-glib.h"
+#include "mono-membar.h"
+#include "hazard-pointer.h"
+#include "atomic.h"
+#include "lock-free-alloc.h"
+
+#define EXPORT	__attribute__ ((visibility ("default")))
+
+#define BOOTSTRAP_SIZE	(64 * 1024)
+
+enum {
+	STATE_UNINITIALIZED,
+	STATE_INITIALIZING,
+	STATE_INITIALIZED
+};
+
+static volatile gint32 state = STATE_UNINITIALIZED;
+static pthread_t initializing_thread;
+static pthread_key_t attached_key;
+
+/* Only used by the initializing thread, so it needs no synchronization. */
+static char bootstrap_buffer [BOOTSTRAP_SIZE] __attribute__ ((aligned (4096)));
+static size_t bootstrap_used;
+
+static gpointer
+bootstrap_alloc (size_t size, size_t alignment)
+{
+	size_t start;
+
+	alignment = MAX (alignment, 16);
+	start = (bootstrap_used + sizeof (size_t) + alignment - 1) & ~(alignment - 1);
+	g_assert (size <= BOOTSTRAP_SIZE && start + size <= BOOTSTRAP_SIZE);
+	bootstrap_used = start + size;
+	((size_t*)(bootstrap_buffer + start)) [-1] = size;
+	return bootstrap_buffer + start;
+}
+
+static gboolean
+bootstrap_contains (gpointer ptr)
+{
+	return (char*)ptr >= bootstrap_buffer && (char*)ptr < bootstrap_buffer + BOOTSTRAP_SIZE;
+}
+
+static size_t
+bootstrap_size (gpointer ptr)
+{
+	return ((size_t*)ptr) [-1];
+}
+
+/* Returns FALSE if we're the thread initializing the allocator. */
+static gboolean
+ensure_initialized (void)
+{
+	if (state == STATE_INITIALIZED)
+		return TRUE;
+
+	if (InterlockedCompareExchange (&state, STATE_INITIALIZING, STATE_UNINITIALIZED) == STATE_UNINITIALIZED) {
+		initializing_thread = pthread_self ();
+		mono_memory_write_barrier ();
+
+		mono_thread_smr_init ();
+		pthread_key_create (&attached_key, NULL);
+		mono_lock_free_malloc_init (MONO_LOCK_FREE_MALLOC_THREAD_CACHES | MONO_LOCK_FREE_MALLOC_PER_CPU_HEAPS |
+				MONO_LOCK_FREE_MALLOC_REMOTE_FREE);
+
+		mono_memory_write_barrier ();
+		state = STATE_INITIALIZED;
+		return TRUE;
+	}
+
+	if (state == STATE_INITIALIZING && pthread_equal (initializing_thread, pthread_self ()))
+		return FALSE;
+
+	while (state != STATE_INITIALIZED)
+		sched_yield ();
+	mono_memory_read_barrier ();
+	return TRUE;
+}
+
+static void
+ensure_attached (void)
+{
+	if (pthread_getspecific (attached_key))
+		return;
+	mono_thread_attach ();
+	pthread_setspecific (attached_key, (gpointer)1);
+}
+
+static gpointer
+do_malloc (size_t size, size_t alignment)
+{
+	if (!ensure_initialized ())
+		return bootstrap_alloc (size, alignment);
+
+	ensure_attached ();
+
+	if (!alignment)
+		return mono_lock_free_malloc (size);
+	return mono_lock_free_malloc_aligned (size, alignment);
+}
+
+EXPORT void*
+malloc (size_t size)
+{
+	void *p = do_malloc (size, 0);
+	if (!p)
+		errno = ENOMEM;
+	return p;
+}
+
+EXPORT void
+free (void *ptr)
+{
+	if (!ptr || !mono_lock_free_owns (ptr))
+		return;
+
+	ensure_attached ();
+	mono_lock_free_free (ptr);
+}
+
+EXPORT void*
+calloc (size_t nmemb, size_t size)
+{
+	void *p;
+
+	if (size && nmemb > ((size_t)-1) / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/*
+	 * Not malloc (), because the compiler would turn malloc ()
+	 * followed by memset () into a call to calloc ().
+	 */
+	p = do_malloc (nmemb * size, 0);
+	if (p)
+		memset (p, 0, nmemb * size);
+	else
+		errno = ENOMEM;
+	return p;
+}
+
+EXPORT size_t
+malloc_usable_size (void *ptr)
+{
+	if (ptr && bootstrap_contains (ptr))
+		return bootstrap_size (ptr);
+	if (!ptr || !mono_lock_free_owns (ptr))
+		return 0;
+	return mono_lock_free_usable_size (ptr);
+}
+
+EXPORT void*
+realloc (void *ptr, size_t size)
+{
+	void *new_ptr;
+
+	if (!ptr)
+		return malloc (size);
+
+	/* Bootstrap blocks are never freed, so we just copy out of them. */
+	if (bootstrap_contains (ptr)) {
+		if (!size)
+			return NULL;
+		new_ptr = malloc (size);
+		if (new_ptr)
+			memcpy (new_ptr, ptr, MIN (size, bootstrap_size (ptr)));
+		return new_ptr;
+	}
+
+	g_assert (mono_lock_free_owns (ptr));
+
+	ensure_attached ();
+	new_ptr = mono_lock_free_realloc (ptr, size);
+	if (!new_ptr && size)
+		errno = ENOMEM;
+	return new_ptr;
+}
+
+EXPORT int
+posix_memalign (void **memptr, size_t alignment, size_t size)
+{
+	void *p;
+
+	if (!alignment || (alignment & (alignment - 1)) || alignment % sizeof (void*))
+		return EINVAL;
+
+	p = do_malloc (size, alignment);
+	if (!p)
+		return ENOMEM;
+	*memptr = p;
+	return 0;
+}
+
+EXPORT void*
+aligned_alloc (size_t alignment, size_t size)
+{
+	void *p;
+
+	if (!alignment || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	p = do_malloc (size, alignment);
+	if (!p)
+		errno = ENOMEM;
+	return p;
+}
+
+/* Not asked for by the standards, but glibc's would mix with ours. */
+EXPORT void*
+memalign (size_t alignment, size_t size)
+{
+	return aligned_alloc (alignment, size);
+}
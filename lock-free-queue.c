@@ -285,7 +285,11 @@ mono_lock_free_queue_dequeue (MonoLockFreeQueue *q)
 		g_assert (q->has_dummy);
 		q->has_dummy = 0;
 		mono_memory_write_barrier ();
-		mono_thread_hazardous_free_or_queue (head, free_dummy, FALSE, TRUE);
+		/*
+		 * There are only a few dummies, so we don't let this
+		 * one wait on our list of retired pointers.
+		 */
+		mono_thread_hazardous_try_free (head, free_dummy);
 		if (try_reenqueue_dummy (q))
 			goto retry;
 		return NULL;
@@ -40,7 +40,7 @@ get_hazardous_pointer_with_mask (gpointer volatile *pp, MonoThreadHazardPointers
 		/* Make it hazardous */
 		mono_hazard_pointer_set (hp, hazard_index, mono_lls_pointer_unmask (p));
 
-		mono_memory_barrier ();
+		mono_hazard_pointer_fence ();
 
 		/* Check that it's still the same.  If not, try
 		   again. */
@@ -1,4 +1,7 @@
-#include <stdio.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
 
 #include "mono-mmap.h"
 
@@ -6,10 +9,8 @@ void*
 mono_valloc (void *addr, size_t len, int prot)
 {
 	addr = mmap (addr, len, prot, MAP_ANON | MAP_PRIVATE, -1, 0);
-	if (addr == (void*)-1) {
-		fprintf (stderr, "mmap error: %m\n");
+	if (addr == (void*)-1)
 		return NULL;
-	}
 	return addr;
 }
 
@@ -18,3 +19,33 @@ mono_vfree (void *addr, size_t len)
 {
 	munmap (addr, len);
 }
+
+void*
+mono_valloc_huge (size_t len, int prot)
+{
+#ifdef MAP_HUGETLB
+	void *addr = mmap (NULL, len, prot, MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+	if (addr != (void*)-1)
+		return addr;
+#endif
+	return NULL;
+}
+
+/*
+ * Asks the kernel to back the not yet touched pages of the range with
+ * memory from the given NUMA node, if it has any.  Returns FALSE if
+ * that's not supported.
+ */
+int
+mono_vbind_node (void *addr, size_t len, int node)
+{
+#if defined(__linux__) && defined(SYS_mbind)
+	/* MPOL_PREFERRED, from numaif.h, which we don't want to depend on. */
+	const int mpol_preferred = 1;
+	unsigned long nodemask = 1UL << node;
+
+	return syscall (SYS_mbind, addr, len, mpol_preferred, &nodemask, sizeof (nodemask) * 8, 0) == 0;
+#else
+	return 0;
+#endif
+}
@@ -12,4 +12,9 @@ void* mono_valloc (void *addr, size_t len, int prot);
 
 void mono_vfree (void *addr, size_t len);
 
+/* Returns NULL if no huge pages are available. */
+void* mono_valloc_huge (size_t len, int prot);
+
+int mono_vbind_node (void *addr, size_t len, int node);
+
 #endif
@@ -1,4 +1,5 @@
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "mono-mmap.h"
 
@@ -21,7 +22,8 @@ mono_sgen_alloc_os_memory (size_t size, int activate)
 	size &= ~(pagesize - 1);
 	ptr = mono_valloc (0, size, prot_flags);
 	/* FIXME: CAS */
-	total_alloc += size;
+	if (ptr)
+		total_alloc += size;
 	return ptr;
 }
 
@@ -41,14 +43,23 @@ mono_sgen_free_os_memory (void *addr, size_t size)
 	total_alloc -= size;
 }
 
+/*
+ * Like mono_sgen_alloc_os_memory_aligned (), but returns NULL if the
+ * OS can't give us the memory.
+ */
 void*
-mono_sgen_alloc_os_memory_aligned (mword size, mword alignment, gboolean activate)
+mono_sgen_try_alloc_os_memory_aligned (mword size, mword alignment, gboolean activate)
 {
-	/* Allocate twice the memory to be able to put the block on an aligned address */
-	char *mem = mono_sgen_alloc_os_memory (size + alignment, activate);
+	char *mem;
 	char *aligned;
 
-	g_assert (mem);
+	if (size > (mword)-1 - alignment)
+		return NULL;
+
+	/* Allocate twice the memory to be able to put the block on an aligned address */
+	mem = mono_sgen_alloc_os_memory (size + alignment, activate);
+	if (!mem)
+		return NULL;
 
 	aligned = (char*)((mword)(mem + (alignment - 1)) & ~(alignment - 1));
 	g_assert (aligned >= mem && aligned + size <= mem + size + alignment && !((mword)aligned & (alignment - 1)));
@@ -60,3 +71,38 @@ mono_sgen_alloc_os_memory_aligned (mword size, mword alignment, gboolean activat
 
 	return aligned;
 }
+
+void*
+mono_sgen_alloc_os_memory_aligned (mword size, mword alignment, gboolean activate)
+{
+	void *mem = mono_sgen_try_alloc_os_memory_aligned (size, alignment, activate);
+
+	g_assert (mem);
+	return mem;
+}
+
+/*
+ * Allocate memory backed by huge pages, aligned to its size, which
+ * must be a multiple of the huge page size.  If the system has no huge
+ * pages reserved we fall back to asking for transparent huge pages.
+ * Returns NULL if we can't get the memory at all.
+ */
+void*
+mono_sgen_alloc_os_memory_huge (mword size)
+{
+	void *ptr = mono_valloc_huge (size, MONO_MMAP_READ | MONO_MMAP_WRITE);
+
+	if (ptr) {
+		g_assert (!((mword)ptr & (size - 1)));
+		/* FIXME: CAS */
+		total_alloc += size;
+		return ptr;
+	}
+
+	ptr = mono_sgen_try_alloc_os_memory_aligned (size, size, TRUE);
+#ifdef MADV_HUGEPAGE
+	if (ptr)
+		madvise (ptr, size, MADV_HUGEPAGE);
+#endif
+	return ptr;
+}
@@ -9,5 +9,7 @@ void* mono_sgen_alloc_os_memory (size_t size, int activate);
 void mono_sgen_free_os_memory (void *addr, size_t size);
 
 void* mono_sgen_alloc_os_memory_aligned (mword size, mword alignment, gboolean activate);
+void* mono_sgen_try_alloc_os_memory_aligned (mword size, mword alignment, gboolean activate);
+void* mono_sgen_alloc_os_memory_huge (mword size);
 
 #endif
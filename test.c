@@ -1,6 +1,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <pthread.h>
 
 #include "hazard-pointer.h"
@@ -51,6 +53,36 @@ typedef struct {
 } ThreadData;
 #endif
 
+#ifdef TEST_MALLOC
+#define USE_SMR
+
+typedef struct {
+	pthread_t thread;
+	int increment;
+	volatile gboolean have_attached;
+} ThreadData;
+#endif
+
+#ifdef TEST_PARTIAL_BENCH
+#define USE_SMR
+
+typedef struct {
+	pthread_t thread;
+	int increment;
+	volatile gboolean have_attached;
+} ThreadData;
+#endif
+
+#ifdef TEST_HAZARD_BENCH
+#define USE_SMR
+
+typedef struct {
+	pthread_t thread;
+	int increment;
+	volatile gboolean have_attached;
+} ThreadData;
+#endif
+
 #ifdef TEST_LLS
 #define USE_SMR
 
@@ -86,14 +118,50 @@ attach_and_wait_for_threads_to_attach (ThreadData *data)
 
 #define TEST_SIZE	64
 
-static MonoLockFreeAllocSizeClass test_sc;
-static MonoLockFreeAllocator test_heap;
+/*
+ * Two size classes on two simulated NUMA nodes, each shared by more
+ * than one allocator, like per-CPU heaps.  They use the two partial
+ * policies the malloc test doesn't.
+ */
+#define NUM_TEST_NODES	2
+#define NUM_TEST_HEAPS	4
+
+static MonoLockFreeAllocSizeClass test_scs [NUM_TEST_NODES];
+static MonoLockFreeAllocator test_heaps [NUM_TEST_HEAPS];
+
+/*
+ * A remote-free size class with few slots per superblock, and a heap
+ * per thread, so that bulk allocations run descriptors full and bump
+ * through fresh superblocks, while other threads' remote frees empty
+ * them again.
+ */
+#define REMOTE_SIZE		2048
+#define NUM_REMOTE_ENTRIES	256
+#define REMOTE_GROUP		4
+
+static MonoLockFreeAllocSizeClass remote_sc;
+static MonoLockFreeAllocator remote_heaps [NUM_THREADS];
+static gpointer remote_entries [NUM_REMOTE_ENTRIES];
 
 static void
 init_heap (void)
 {
-	mono_lock_free_allocator_init_size_class (&test_sc, TEST_SIZE);
-	mono_lock_free_allocator_init_allocator (&test_heap, &test_sc);
+	int i;
+
+	mono_lock_free_numa_simulate (NUM_TEST_NODES);
+	for (i = 0; i < NUM_TEST_NODES; ++i) {
+		mono_lock_free_allocator_init_size_class_full (&test_scs [i], TEST_SIZE,
+				i ? MONO_LOCK_FREE_ALLOC_PARTIAL_FULLEST_FIRST : MONO_LOCK_FREE_ALLOC_PARTIAL_LIFO);
+		mono_lock_free_allocator_set_size_class_node (&test_scs [i], i);
+		if (i > 0)
+			mono_lock_free_allocator_link_size_classes (&test_scs [0], &test_scs [i]);
+	}
+	for (i = 0; i < NUM_TEST_HEAPS; ++i)
+		mono_lock_free_allocator_init_allocator (&test_heaps [i], &test_scs [i * NUM_TEST_NODES / NUM_TEST_HEAPS]);
+
+	mono_lock_free_allocator_init_size_class_full (&remote_sc, REMOTE_SIZE, MONO_LOCK_FREE_ALLOC_REMOTE_FREE);
+	for (i = 0; i < NUM_THREADS; ++i)
+		mono_lock_free_allocator_init_allocator (&remote_heaps [i], &remote_sc);
 }
 
 enum {
@@ -153,11 +221,47 @@ dump_action_logs (void)
 	}
 }
 
+/*
+ * Frees, in bulk, the group of remote entries at index, which other
+ * threads are likely to have allocated, or allocates a group if they
+ * are all empty.
+ */
+static void
+remote_step (ThreadData *data, int index)
+{
+	MonoLockFreeAllocator *heap = &remote_heaps [data - thread_datas];
+	gpointer group [REMOTE_GROUP];
+	int i, n = 0;
+
+	for (i = 0; i < REMOTE_GROUP; ++i) {
+		int j = (index + i) % NUM_REMOTE_ENTRIES;
+		gpointer p = remote_entries [j];
+		if (p && InterlockedCompareExchangePointer ((gpointer * volatile)&remote_entries [j], NULL, p) == p) {
+			g_assert (*(int*)p == j);
+			group [n++] = p;
+		}
+	}
+	if (n) {
+		mono_lock_free_free_bulk (group, n);
+		return;
+	}
+
+	n = mono_lock_free_alloc_bulk (heap, REMOTE_GROUP, group);
+	g_assert (n == REMOTE_GROUP);
+	for (i = 0; i < REMOTE_GROUP; ++i) {
+		int j = (index + i) % NUM_REMOTE_ENTRIES;
+		*(int*)group [i] = j;
+		if (InterlockedCompareExchangePointer ((gpointer * volatile)&remote_entries [j], group [i], NULL) != NULL)
+			mono_lock_free_free (group [i]);
+	}
+}
+
 static void*
 thread_func (void *_data)
 {
 	ThreadData *data = _data;
 	int increment = data->increment;
+	MonoLockFreeAllocator *heap = &test_heaps [(data - thread_datas) % NUM_TEST_HEAPS];
 	int i, index;
 
 	attach_and_wait_for_threads_to_attach (data);
@@ -176,7 +280,7 @@ thread_func (void *_data)
 
 			log_action (data, ACTION_FREE, index, p);
 		} else {
-			p = mono_lock_free_alloc (&test_heap);
+			p = mono_lock_free_alloc (heap);
 
 			/*
 			int j;
@@ -200,6 +304,9 @@ thread_func (void *_data)
 			}
 		}
 
+		if (!(i & 3))
+			remote_step (data, index);
+
 		index += increment;
 		while (index >= NUM_ENTRIES)
 			index -= NUM_ENTRIES;
@@ -218,18 +325,343 @@ thread_func (void *_data)
 	return NULL;
 }
 
+#define NUM_BULK	2000
+
+static void
+test_bulk (void)
+{
+	static gpointer bulk [NUM_BULK];
+	int i;
+
+	/* Spans several superblocks. */
+	mono_lock_free_alloc_bulk (&test_heaps [0], NUM_BULK, bulk);
+	for (i = 0; i < NUM_BULK; ++i)
+		*(int*)bulk [i] = i;
+	for (i = 0; i < NUM_BULK; ++i)
+		g_assert (*(int*)bulk [i] == i);
+
+	mono_lock_free_free_bulk (bulk, NUM_BULK);
+	for (i = 1; i < NUM_BULK; ++i)
+		g_assert (bulk [i - 1] < bulk [i]);
+}
+
+/*
+ * Leaves node 0 with enough partial superblocks that node 1 steals
+ * some of them, then frees everything.  The stats of both classes must
+ * come out even, no matter which class the slots were freed from.
+ */
+static void
+test_steal (void)
+{
+	static gpointer bulk [NUM_BULK], stolen [NUM_BULK / 2];
+	MonoLockFreeAllocStats stats;
+	int i;
+
+	mono_lock_free_alloc_bulk (&test_heaps [0], NUM_BULK, bulk);
+	for (i = 0; i < NUM_BULK / 2; ++i)
+		mono_lock_free_free (bulk [i * 2]);
+	mono_lock_free_alloc_bulk (&test_heaps [NUM_TEST_HEAPS - 1], NUM_BULK / 2, stolen);
+	for (i = 0; i < NUM_BULK / 2; ++i) {
+		mono_lock_free_free (bulk [i * 2 + 1]);
+		mono_lock_free_free (stolen [i]);
+	}
+
+	for (i = 0; i < NUM_TEST_NODES; ++i) {
+		mono_lock_free_allocator_get_stats (&test_scs [i], &stats);
+		g_assert (stats.live_superblocks >= 0);
+		g_assert (stats.live_bytes == 0);
+	}
+}
+
+/*
+ * With no address space left, allocating must fail instead of
+ * aborting, once the superblocks we still have are used up.
+ */
+static void
+test_out_of_memory (void)
+{
+	static MonoLockFreeAllocSizeClass sc;
+	static MonoLockFreeAllocator heap;
+	static gpointer bulk [NUM_BULK];
+	struct rlimit old_limit, limit;
+	int i, n;
+
+	mono_lock_free_allocator_init_size_class (&sc, 4096);
+	mono_lock_free_allocator_init_allocator (&heap, &sc);
+
+	getrlimit (RLIMIT_AS, &old_limit);
+	limit = old_limit;
+	limit.rlim_cur = 0;
+	setrlimit (RLIMIT_AS, &limit);
+
+	for (n = 0; n < NUM_BULK; ++n) {
+		if (!(bulk [n] = mono_lock_free_alloc (&heap)))
+			break;
+	}
+	g_assert (n < NUM_BULK);
+	g_assert (mono_lock_free_alloc_bulk (&heap, 4, bulk + n) == 0);
+
+	setrlimit (RLIMIT_AS, &old_limit);
+
+	n += mono_lock_free_alloc_bulk (&heap, 4, bulk + n);
+	for (i = 0; i < n; ++i)
+		mono_lock_free_free (bulk [i]);
+}
+
 static void
 test_init (void)
 {
 	init_heap ();
-	mono_lock_free_alloc (&test_heap);
+	test_bulk ();
+	test_steal ();
+	test_out_of_memory ();
+	mono_lock_free_alloc (&test_heaps [0]);
 }
 
 static gboolean
 test_finish (void)
 {
-	if (mono_lock_free_allocator_check_consistency (&test_heap)) {
-		g_print ("heap consistent\n");
+	MonoLockFreeAllocStats stats;
+	long live_bytes = 0;
+	int i, num_live = 1;	/* the slot allocated by test_init () */
+	int num_remote_live = 0;
+
+	for (i = 0; i < NUM_ENTRIES; ++i) {
+		if (entries [i])
+			++num_live;
+	}
+	for (i = 0; i < NUM_REMOTE_ENTRIES; ++i) {
+		if (remote_entries [i])
+			++num_remote_live;
+	}
+	for (i = 0; i < NUM_TEST_NODES; ++i) {
+		mono_lock_free_allocator_get_stats (&test_scs [i], &stats);
+		g_print ("size class %d: %lu allocs, %lu anchor CAS retries, %ld live superblocks\n",
+				i, stats.allocs, stats.anchor_cas_retries, stats.live_superblocks);
+		g_assert (stats.live_superblocks >= 0);
+		g_assert (stats.live_bytes >= 0);
+		live_bytes += stats.live_bytes;
+	}
+	g_assert (live_bytes == num_live * TEST_SIZE);
+
+	mono_lock_free_allocator_get_stats (&remote_sc, &stats);
+	g_print ("remote-free size class: %lu allocs, %lu anchor CAS retries, %ld live superblocks\n",
+			stats.allocs, stats.anchor_cas_retries, stats.live_superblocks);
+	g_assert (stats.live_superblocks >= 0);
+	g_assert (stats.live_bytes == num_remote_live * REMOTE_SIZE);
+
+	for (i = 0; i < NUM_TEST_HEAPS; ++i) {
+		if (!mono_lock_free_allocator_check_consistency (&test_heaps [i]))
+			return FALSE;
+	}
+	for (i = 0; i < NUM_THREADS; ++i) {
+		if (!mono_lock_free_allocator_check_consistency (&remote_heaps [i]))
+			return FALSE;
+	}
+
+	/*
+	 * Stolen descriptors count against the class that created
+	 * them, so once everything is freed each class must be back to
+	 * what it had before the threads started: the slot from
+	 * test_init (), which no other class could have stolen yet.
+	 */
+	for (i = 0; i < NUM_ENTRIES; ++i) {
+		if (entries [i]) {
+			mono_lock_free_free (entries [i]);
+			entries [i] = NULL;
+		}
+	}
+	for (i = 0; i < NUM_TEST_NODES; ++i) {
+		mono_lock_free_allocator_get_stats (&test_scs [i], &stats);
+		g_assert (stats.live_superblocks >= 0);
+		g_assert (stats.live_bytes == (i ? 0 : TEST_SIZE));
+	}
+	g_print ("heaps consistent\n");
+	return TRUE;
+}
+
+#endif
+
+#ifdef TEST_MALLOC
+
+#define NUM_ENTRIES	1024
+#define NUM_ITERATIONS	1000000
+
+typedef struct {
+	gpointer p;
+	size_t size;
+} MallocEntry;
+
+static MallocEntry entries [NUM_ENTRIES];
+
+/* Mostly small sizes, with the occasional large object. */
+static size_t
+entry_size (int index, int i)
+{
+	unsigned int x = (unsigned int)(index * 2654435761u + i * 40503u);
+	if (!(x & 0xff0))
+		return 8192 + (x >> 12) % (256 * 1024);
+	return (x >> 7) % ((x & 3) ? 256 : 8000);
+}
+
+static void
+fill_entry (guint8 *p, size_t size, int index)
+{
+	size_t i;
+	for (i = 0; i < size; ++i)
+		p [i] = (guint8)(index + i);
+}
+
+static void
+check_entry (guint8 *p, size_t size, int index)
+{
+	size_t i;
+	for (i = 0; i < size; ++i)
+		g_assert (p [i] == (guint8)(index + i));
+}
+
+static void*
+thread_func (void *_data)
+{
+	ThreadData *data = _data;
+	int increment = data->increment;
+	int i, index;
+
+	attach_and_wait_for_threads_to_attach (data);
+
+	index = 0;
+	for (i = 0; i < NUM_ITERATIONS; ++i) {
+		MallocEntry *e = &entries [index];
+		gpointer p;
+	retry:
+		p = e->p;
+		if (p == (gpointer)1) {
+			/* Another thread is just filling this entry. */
+		} else if (p && !(i & 7)) {
+			/* Resize the entry, keeping it claimed while we do. */
+			size_t size = e->size;
+			size_t new_size = entry_size (index, i) + 1;
+			if (InterlockedCompareExchangePointer ((gpointer * volatile)&e->p, (gpointer)1, p) != p)
+				goto retry;
+			check_entry (p, size, index);
+			p = mono_lock_free_realloc (p, new_size);
+			g_assert (p);
+			check_entry (p, MIN (size, new_size), index);
+			fill_entry (p, new_size, index);
+			e->size = new_size;
+			mono_memory_write_barrier ();
+			e->p = p;
+		} else if (p) {
+			size_t size = e->size;
+			if (InterlockedCompareExchangePointer ((gpointer * volatile)&e->p, NULL, p) != p)
+				goto retry;
+			check_entry (p, size, index);
+			mono_lock_free_free (p);
+		} else {
+			size_t size = entry_size (index, i);
+
+			if (i % 13) {
+				p = mono_lock_free_malloc (size);
+				g_assert (p);
+				g_assert (!((gulong)p & (size > 8 ? 15 : 7)));
+			} else {
+				p = mono_lock_free_malloc_aligned (size, 64);
+				g_assert (p);
+				g_assert (!((gulong)p & 63));
+			}
+			fill_entry (p, size, index);
+
+			/*
+			 * The size is only published together with the
+			 * pointer, so a concurrent reader can't see the
+			 * new size with the old pointer.
+			 */
+			if (InterlockedCompareExchangePointer ((gpointer * volatile)&e->p, (gpointer)1, NULL) != NULL) {
+				mono_lock_free_free (p);
+				goto retry;
+			}
+			e->size = size;
+			mono_memory_write_barrier ();
+			e->p = p;
+		}
+
+		index += increment;
+		while (index >= NUM_ENTRIES)
+			index -= NUM_ENTRIES;
+
+		if (i % (NUM_ITERATIONS / 10) == 0)
+			g_print ("thread %d: %d\n", increment, i);
+	}
+
+	return NULL;
+}
+
+static void
+test_init (void)
+{
+	guint32 flags = MONO_LOCK_FREE_MALLOC_THREAD_CACHES | MONO_LOCK_FREE_MALLOC_PER_CPU_HEAPS |
+		MONO_LOCK_FREE_MALLOC_REMOTE_FREE | MONO_LOCK_FREE_MALLOC_NUMA;
+	gpointer p;
+
+#ifdef TEST_HUGE_PAGES
+	/* Without the arena, so that huge superblocks get mappings of their own. */
+	flags |= MONO_LOCK_FREE_MALLOC_HUGE_PAGES;
+#else
+	flags |= MONO_LOCK_FREE_MALLOC_ARENA;
+#endif
+
+	/* Keep the superblock cache small so that arena superblocks get recycled. */
+	mono_lock_free_allocator_set_sb_cache_watermarks (0, 256 * 1024);
+	mono_lock_free_numa_simulate (2);
+	mono_lock_free_malloc_init (flags);
+
+	/*
+	 * A 1 MB object and its header still fit the large span cache,
+	 * so we get the same span back, not a fresh mapping.  The span
+	 * is cached right away, not after a scan.  Trimming releases it,
+	 * so then we get fresh memory.
+	 */
+	p = mono_lock_free_malloc (1024 * 1024);
+	((char*)p) [1024 * 1024 - 1] = 1;
+	mono_lock_free_free (p);
+	g_assert (mono_lock_free_malloc (1024 * 1024) == p && ((char*)p) [1024 * 1024 - 1] == 1);
+	mono_lock_free_free (p);
+	mono_lock_free_allocator_trim ();
+	p = mono_lock_free_malloc (1024 * 1024);
+	g_assert (((char*)p) [1024 * 1024 - 1] == 0);
+	mono_lock_free_free (p);
+
+	/* Trim all the time, while the other threads allocate and free. */
+	mono_lock_free_allocator_start_scavenger (1, 50);
+
+	g_assert (mono_lock_free_malloc ((size_t)-1) == NULL);
+	/* Fits the size arithmetic, but not the address space. */
+	g_assert (mono_lock_free_malloc ((size_t)1 << 47) == NULL);
+	g_assert (mono_lock_free_alloc_large_aligned ((size_t)1 << 46, (size_t)1 << 46) == NULL);
+
+	/* Power of two size classes are naturally aligned. */
+	p = mono_lock_free_malloc (128);
+	g_assert (!((gulong)p & 127));
+	mono_lock_free_free (p);
+}
+
+static gboolean
+test_finish (void)
+{
+	int i;
+
+	for (i = 0; i < NUM_ENTRIES; ++i) {
+		if (entries [i].p) {
+			check_entry (entries [i].p, entries [i].size, i);
+			mono_lock_free_free (entries [i].p);
+			entries [i].p = NULL;
+		}
+	}
+
+	mono_lock_free_allocator_trim ();
+
+	if (mono_lock_free_malloc_check_consistency ()) {
+		g_print ("heaps consistent\n");
 		return TRUE;
 	}
 	return FALSE;
@@ -443,6 +875,231 @@ test_finish (void)
 }
 #endif
 
+#ifdef TEST_PARTIAL_BENCH
+
+/*
+ * Not a test but a benchmark of the partial superblock policies.  Every
+ * thread allocates its objects and frees a random three quarters of
+ * them, which leaves lots of partial superblocks behind.  Then it
+ * replaces random live objects with new ones.  Run with PARTIAL_POLICY
+ * set to fifo, lifo or fullest, and compare the time, the number of
+ * superblocks still alive and the RSS.
+ */
+#define BENCH_SIZE		64
+#define BENCH_OBJECTS		200000	/* per thread */
+#define BENCH_ITERATIONS	5000000
+
+static MonoLockFreeAllocSizeClass bench_sc;
+static MonoLockFreeAllocator bench_heaps [NUM_THREADS];
+static gpointer *bench_objects [NUM_THREADS];
+static int bench_live [NUM_THREADS];
+static struct timeval bench_start;
+
+static long
+rss_kb (void)
+{
+	long size, resident = 0;
+	FILE *f = fopen ("/proc/self/statm", "r");
+
+	if (f) {
+		if (fscanf (f, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		fclose (f);
+	}
+	return resident * (getpagesize () / 1024);
+}
+
+static void*
+thread_func (void *_data)
+{
+	ThreadData *data = _data;
+	int thread = data - thread_datas;
+	MonoLockFreeAllocator *heap = &bench_heaps [thread];
+	gpointer *objects = bench_objects [thread];
+	unsigned int seed = data->increment;
+	int i, live;
+
+	attach_and_wait_for_threads_to_attach (data);
+
+	for (i = 0; i < BENCH_OBJECTS; ++i)
+		objects [i] = mono_lock_free_alloc (heap);
+
+	/* The live objects are kept at the start of the array. */
+	for (live = BENCH_OBJECTS; live > BENCH_OBJECTS / 4; --live) {
+		int index = rand_r (&seed) % live;
+		mono_lock_free_free (objects [index]);
+		objects [index] = objects [live - 1];
+	}
+
+	for (i = 0; i < BENCH_ITERATIONS; ++i) {
+		int index = rand_r (&seed) % live;
+		mono_lock_free_free (objects [index]);
+		objects [index] = mono_lock_free_alloc (heap);
+	}
+
+	bench_live [thread] = live;
+	return NULL;
+}
+
+static void
+test_init (void)
+{
+	const char *policy = getenv ("PARTIAL_POLICY");
+	guint32 flags = 0;
+	int i;
+
+	if (policy && !strcmp (policy, "lifo"))
+		flags = MONO_LOCK_FREE_ALLOC_PARTIAL_LIFO;
+	else if (policy && !strcmp (policy, "fullest"))
+		flags = MONO_LOCK_FREE_ALLOC_PARTIAL_FULLEST_FIRST;
+	else
+		policy = "fifo";
+	g_print ("policy %s\n", policy);
+
+	/* Retired superblocks go back to the OS right away. */
+	mono_lock_free_allocator_set_sb_cache_watermarks (0, 0);
+	mono_lock_free_allocator_init_size_class_full (&bench_sc, BENCH_SIZE, flags);
+	for (i = 0; i < NUM_THREADS; ++i) {
+		mono_lock_free_allocator_init_allocator (&bench_heaps [i], &bench_sc);
+		bench_objects [i] = calloc (BENCH_OBJECTS, sizeof (gpointer));
+	}
+
+	gettimeofday (&bench_start, NULL);
+}
+
+static gboolean
+test_finish (void)
+{
+	MonoLockFreeAllocStats stats;
+	struct timeval end;
+	long live = 0;
+	int i;
+
+	gettimeofday (&end, NULL);
+	mono_lock_free_allocator_get_stats (&bench_sc, &stats);
+
+	for (i = 0; i < NUM_THREADS; ++i)
+		live += bench_live [i];
+
+	g_print ("time %.2fs, %ld objects in %ld superblocks (%ld bytes), rss %ld kB\n",
+			(end.tv_sec - bench_start.tv_sec) + (end.tv_usec - bench_start.tv_usec) / 1e6,
+			live, stats.live_superblocks, stats.live_bytes, rss_kb ());
+
+	for (i = 0; i < NUM_THREADS; ++i) {
+		if (mono_lock_free_allocator_check_consistency (&bench_heaps [i]))
+			g_print ("heaps consistent\n");
+	}
+	return TRUE;
+}
+
+#endif
+
+#ifdef TEST_HAZARD_BENCH
+
+/*
+ * Not a test but a benchmark of hazard pointer readers.  Thread 0
+ * keeps replacing a shared node and retiring the old one, which makes
+ * it scan the hazard pointers, while the other threads read the node
+ * through hazard pointers as fast as they can.  The readers' rate
+ * suffers if their hazard pointers share cache lines.  Set
+ * MONO_SMR_SYMMETRIC_FENCES to compare against readers that fence.
+ * "make hazard-bench" runs it with padded and with packed records.
+ */
+#define BENCH_READS	50000000	/* per reader */
+
+typedef struct {
+	int value;
+} BenchNode;
+
+static BenchNode * volatile bench_node;
+static volatile gboolean bench_done;
+static volatile gint32 bench_readers_done;
+static long bench_writes;
+static double bench_reader_times [NUM_THREADS];
+
+static double
+now (void)
+{
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static BenchNode*
+bench_node_new (int value)
+{
+	BenchNode *node = g_malloc0 (sizeof (BenchNode));
+	node->value = value;
+	return node;
+}
+
+static void
+bench_node_free (gpointer node)
+{
+	g_free (node);
+}
+
+static void*
+thread_func (void *_data)
+{
+	ThreadData *data = _data;
+	int thread = data - thread_datas;
+	MonoThreadHazardPointers *hp;
+	double start;
+	int i;
+
+	attach_and_wait_for_threads_to_attach (data);
+	hp = mono_hazard_pointer_get ();
+
+	if (thread == 0) {
+		while (!bench_done) {
+			BenchNode *old = InterlockedExchangePointer ((gpointer * volatile)&bench_node, bench_node_new (bench_writes));
+			mono_thread_hazardous_free_or_queue (old, bench_node_free, FALSE, TRUE);
+			++bench_writes;
+		}
+		return NULL;
+	}
+
+	start = now ();
+	for (i = 0; i < BENCH_READS; ++i) {
+		BenchNode *node = get_hazardous_pointer ((gpointer volatile*)&bench_node, hp, 0);
+		g_assert (node->value >= 0);
+		mono_hazard_pointer_clear (hp, 0);
+	}
+	bench_reader_times [thread] = now () - start;
+
+	if (InterlockedIncrement (&bench_readers_done) == NUM_THREADS - 1)
+		bench_done = TRUE;
+	return NULL;
+}
+
+static void
+test_init (void)
+{
+	g_assert (NUM_THREADS >= 2);
+	g_print ("%d-byte hazard records, %s fences\n", (int)sizeof (MonoThreadHazardPointers),
+			mono_hazard_pointer_asymmetric_fences ? "asymmetric" : "symmetric");
+	bench_node = bench_node_new (0);
+}
+
+static gboolean
+test_finish (void)
+{
+	int i;
+
+	for (i = 1; i < NUM_THREADS; ++i) {
+		g_print ("reader %d: %.2fs, %.1fM reads/s\n", i, bench_reader_times [i],
+				BENCH_READS / bench_reader_times [i] / 1e6);
+	}
+	g_print ("%ld writes\n", bench_writes);
+
+	g_free (bench_node);
+	return TRUE;
+}
+
+#endif
+
 #ifdef TEST_LLS
 enum {
 	STATE_FREE,